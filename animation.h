@@ -0,0 +1,180 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shader.h"
+#include "mesh.h"
+#include "modelcache.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+// Bone of a rigged model, skinned vertices refer to it by its index in the model's bone list
+struct Bone {
+    int node;          // Scene node the bone follows, -1 if the file has none
+    glm::mat4 offset;  // From mesh space in the bind pose into the bone's space
+};
+
+template <typename T>
+struct AnimationKey {
+    double time; // In ticks
+    T value;
+};
+
+// Keyframes for one scene node, any of the tracks may be empty to keep the node's bind pose for it
+struct AnimationChannel {
+    int node;
+    vector<AnimationKey<glm::vec3>> positions;
+    vector<AnimationKey<glm::quat>> rotations;
+    vector<AnimationKey<glm::vec3>> scales;
+};
+
+struct Animation {
+    string name;
+    double duration = 0.0;       // In ticks
+    double ticksPerSecond = 25.0;
+    vector<AnimationChannel> channels;
+};
+
+// Value of a track at a time, holding the first and last keys outside their range
+glm::vec3 sampleKeys(const vector<AnimationKey<glm::vec3>> &keys, double time)
+{
+    auto next = upper_bound(keys.begin(), keys.end(), time, [](double t, const AnimationKey<glm::vec3> &key) { return t < key.time; });
+    if (next == keys.begin())
+        return keys.front().value;
+    if (next == keys.end())
+        return keys.back().value;
+    auto previous = next - 1;
+    float t = (float)((time - previous->time) / (next->time - previous->time));
+    return glm::mix(previous->value, next->value, t);
+}
+
+glm::quat sampleKeys(const vector<AnimationKey<glm::quat>> &keys, double time)
+{
+    auto next = upper_bound(keys.begin(), keys.end(), time, [](double t, const AnimationKey<glm::quat> &key) { return t < key.time; });
+    if (next == keys.begin())
+        return keys.front().value;
+    if (next == keys.end())
+        return keys.back().value;
+    auto previous = next - 1;
+    float t = (float)((time - previous->time) / (next->time - previous->time));
+    return glm::normalize(glm::slerp(previous->value, next->value, t));
+}
+
+// Plays one of a model's animations, sampling its keyframes into a bone palette on the CPU and handing the
+// palette to the vertex shader through a uniform buffer. The vectors are borrowed from the model.
+class Animator {
+    public:
+        vector<glm::mat4> palette; // Per bone, from the bind pose in mesh space to the animated pose in model space
+        size_t animation = 0;
+        double time = 0.0;         // In ticks
+
+        Animator(const vector<SceneNode> &nodes, const vector<Bone> &bones, const vector<Animation> &animations)
+            : nodes(nodes), bones(bones), animations(animations)
+        {
+        }
+
+        ~Animator()
+        {
+            // Deleting the palette detaches it, put the identity one back
+            if (ubo) {
+                glDeleteBuffers(1, &ubo);
+                ensureBonePalette();
+            }
+        }
+
+        Animator(const Animator&) = delete;
+        Animator& operator=(const Animator&) = delete;
+
+        // Play an animation from the start, an index past the last one holds the bind pose
+        void play(size_t index)
+        {
+            animation = index;
+            time = 0.0;
+        }
+
+        // Advance the clock, looping, and pose the skeleton
+        void update(float deltaSeconds)
+        {
+            const Animation *current = animation < animations.size() ? &animations[animation] : NULL;
+            if (current && current->duration > 0.0) {
+                time = fmod(time + deltaSeconds * current->ticksPerSecond, current->duration);
+                if (time < 0.0)
+                    time += current->duration;
+            }
+            pose();
+        }
+
+        // Sample the animation at the current time into the node transforms and the palette, needs no GL
+        void pose()
+        {
+            const Animation *current = animation < animations.size() ? &animations[animation] : NULL;
+
+            // Start from the bind pose, then overwrite the animated nodes
+            local.resize(nodes.size());
+            for (size_t i = 0; i < nodes.size(); i++)
+                local[i] = nodes[i].local;
+            if (current) {
+                for (const AnimationChannel &channel : current->channels) {
+                    if (channel.node < 0 || (size_t)channel.node >= nodes.size())
+                        continue;
+                    // Tracks the channel doesn't have keep the bind pose's value
+                    const glm::mat4 &bind = local[channel.node];
+                    glm::vec3 bindScale(glm::length(glm::vec3(bind[0])), glm::length(glm::vec3(bind[1])), glm::length(glm::vec3(bind[2])));
+                    glm::mat3 bindRotation(glm::vec3(bind[0]) / bindScale.x, glm::vec3(bind[1]) / bindScale.y, glm::vec3(bind[2]) / bindScale.z);
+
+                    glm::vec3 position = channel.positions.empty() ? glm::vec3(bind[3]) : sampleKeys(channel.positions, time);
+                    glm::quat rotation = channel.rotations.empty() ? glm::quat_cast(bindRotation) : sampleKeys(channel.rotations, time);
+                    glm::vec3 scale = channel.scales.empty() ? bindScale : sampleKeys(channel.scales, time);
+                    local[channel.node] = glm::scale(glm::translate(glm::mat4(1.0f), position) * glm::mat4_cast(rotation), scale);
+                }
+            }
+
+            // Parents come before their children
+            world.resize(nodes.size());
+            for (size_t i = 0; i < nodes.size(); i++)
+                world[i] = nodes[i].parent >= 0 ? world[nodes[i].parent] * local[i] : local[i];
+
+            palette.resize(std::min<size_t>(bones.size(), MAX_BONES));
+            for (size_t b = 0; b < palette.size(); b++) {
+                const Bone &bone = bones[b];
+                palette[b] = bone.node >= 0 && (size_t)bone.node < world.size() ? world[bone.node] * bone.offset : glm::mat4(1.0f);
+            }
+        }
+
+        // Upload the palette and attach it to BONE_BINDING, every program's "Bones" block, once per frame before drawing
+        void bind()
+        {
+            if (!ubo) {
+                glGenBuffers(1, &ubo);
+                glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+                glBufferData(GL_UNIFORM_BUFFER, MAX_BONES * sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+            }
+            glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+            glState().bufferSubData(GL_UNIFORM_BUFFER, 0, palette.size() * sizeof(glm::mat4), palette.data());
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            glBindBufferBase(GL_UNIFORM_BUFFER, BONE_BINDING, ubo);
+        }
+
+        // Model space transform of each scene node in the current pose
+        const vector<glm::mat4>& worldTransforms() const { return world; }
+
+    private:
+        const vector<SceneNode> &nodes;
+        const vector<Bone> &bones;
+        const vector<Animation> &animations;
+
+        unsigned int ubo = 0;
+        vector<glm::mat4> local, world;
+};
+
+#endif
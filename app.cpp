@@ -51,7 +51,10 @@ bool mouseActive = false;
 
 // UI settings
 bool spinning = false;
+int encoderThreads = 4;
+bool exportGif = false;
 std::string filename = "output/test.png";
+std::string gifFilename = "output/test.gif";
 
 // Frame timing
 float deltaTime = 0.0f;
@@ -95,7 +98,7 @@ int main()
         return -1;
     }
     glfwMakeContextCurrent(window);
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    glfwSetInputMode(window, GLFW_CURSOR, mouseActive ? GLFW_CURSOR_DISABLED : GLFW_CURSOR_NORMAL);
     
     // Attach callbacks
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
@@ -114,51 +117,32 @@ int main()
     Shader screenShader("screenshader.vert", "screenshader.frag");
 
     // Load models
-    Model testModel(filesystem::path("resources/models/space-ame-camping-amelia-watson-hololive/spaceamesketchfab2.obj"));
+    // Stream the model in so the window stays responsive while it loads
+    ModelOptions modelOptions;
+    modelOptions.streaming = true;
+    Model testModel(filesystem::path("resources/models/space-ame-camping-amelia-watson-hololive/spaceamesketchfab2.obj"), modelOptions);
 
-    // Create and bind frame buffer object
-    unsigned int FBO;
-    glGenFramebuffers(1, &FBO); // We will render to this and then use it as a texture for our fullscreen quad
-    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    // Plays the model's first animation if it's rigged
+    Animator animator(testModel.nodes, testModel.bones, testModel.animations);
 
-    // Create frame buffer texture and attach to FBO
+    // Create frame buffer object, we will render to this and then use it as a texture for our fullscreen quad
     unsigned int framebufferTexture;
-    glGenTextures(1, &framebufferTexture);
-    glBindTexture(GL_TEXTURE_2D, framebufferTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, RENDER_SIZE_X, RENDER_SIZE_Y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, framebufferTexture, 0);
-
-    // Create render buffer
-    unsigned int RBO;
-    glGenRenderbuffers(1, &RBO);
-    glBindRenderbuffer(GL_RENDERBUFFER, RBO);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, RENDER_SIZE_X, RENDER_SIZE_Y);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, RBO);
-
-    auto fboStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (fboStatus != GL_FRAMEBUFFER_COMPLETE)
-        std::cout << "ERROR::FRAMEBUFFER::" << fboStatus << std::endl;
+    unsigned int FBO = createRenderTarget(RENDER_SIZE_X, RENDER_SIZE_Y, framebufferTexture);
 
     // Screen quad
     unsigned int quadVAO, quadVBO;
     glGenVertexArrays(1, &quadVAO);
     glGenBuffers(1, &quadVBO);
-    glBindVertexArray(quadVAO);
+    glState().bindVertexArray(quadVAO);
     glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(fullscreenQuad), &fullscreenQuad, GL_STATIC_DRAW);
+    glState().bufferData(GL_ARRAY_BUFFER, sizeof(fullscreenQuad), &fullscreenQuad, GL_STATIC_DRAW);
     glEnableVertexAttribArray(0); // Set position
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(1); // Set UV coords
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
 
     screenShader.use();
-    glUniform1i(glGetUniformLocation(screenShader.ID, "screenTexture"), 0);
+    screenShader.setInt("screenTexture", 0);
 
     // Setup imgui version
     IMGUI_CHECKVERSION();
@@ -168,7 +152,8 @@ int main()
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init("#version 330");
 
-    Renderer renderer(shader1, testModel, FBO, filename, RENDER_SIZE_X, RENDER_SIZE_Y);
+    Renderer renderer(shader1, testModel, FBO, filename, RENDER_SIZE_X, RENDER_SIZE_Y, encoderThreads);
+    CameraBuffer camera;
 
     // Render loop
     while(!glfwWindowShouldClose(window))
@@ -181,12 +166,9 @@ int main()
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
 
-        // Enable mouse
-        if (!mouseActive)
-            glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
-        else
-            glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-        
+        // Counters start over, last frame's are shown in the stats panel
+        glState().beginFrame();
+
         // Low-res buffer
         glBindFramebuffer(GL_FRAMEBUFFER, FBO);
         glViewport(0, 0, RENDER_SIZE_X, RENDER_SIZE_Y);
@@ -194,7 +176,7 @@ int main()
         // Render commands
         glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glEnable(GL_DEPTH_TEST);
+        glState().enable(GL_DEPTH_TEST);
         shader1.use();
 
         ImGui_ImplOpenGL3_NewFrame();
@@ -216,31 +198,53 @@ int main()
         projection = glm::perspective(glm::radians(fov), (float)WINDOW_SIZE_X/(float)WINDOW_SIZE_Y, 0.1f, 100.0f);
         
         // Send transforms to shader
-        int modelLoc = glGetUniformLocation(shader1.ID, "model");
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-        int viewLoc = glGetUniformLocation(shader1.ID, "view");
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        int projectionLoc = glGetUniformLocation(shader1.ID, "projection");
-        glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));
+        shader1.setMat4("model", model);
+        camera.set(view, projection);
+
+        // Upload a little more of the model each frame until it's loaded
+        testModel.update();
+        if (!testModel.bones.empty()) {
+            animator.update(deltaTime);
+            animator.bind();
+        }
 
-        testModel.Draw(shader1);
+        // LODs are picked for the low-res buffer
+        testModel.Draw(shader1, model, view, projection, RENDER_SIZE_Y);
+        renderer.setCamera(view, projection);
 
         // Render framebuffer to screen
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
         glViewport(0, 0, WINDOW_SIZE_X, WINDOW_SIZE_Y);
         screenShader.use();
-        glBindVertexArray(quadVAO);
-        glDisable(GL_DEPTH_TEST);
-        glBindTexture(GL_TEXTURE_2D, framebufferTexture);
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+        glState().bindVertexArray(quadVAO);
+        glState().disable(GL_DEPTH_TEST);
+        glState().bindTexture(0, GL_TEXTURE_2D, framebufferTexture);
+        glState().drawArrays(GL_TRIANGLES, 0, 6);
 
         ImGui::Begin("Export");
         ImGui::Checkbox("Spin", &spinning);
-        if (ImGui::Button("Render")) {
-            renderer.renderSpin(48, filename);
+        // Rebuilding the pool joins its threads, so only do it once the slider is released
+        ImGui::SliderInt("Encoder threads", &encoderThreads, 1, 32);
+        if (ImGui::IsItemDeactivatedAfterEdit())
+            renderer.setEncoderThreads(encoderThreads);
+        ImGui::Checkbox("Animated GIF", &exportGif);
+        ImGui::Text("Meshes drawn: %u, culled: %u, static batch: %u", testModel.visibleMeshes, testModel.culledMeshes, testModel.batchedMeshes());
+        if (!testModel.isLoaded())
+            ImGui::Text("Loading model...");
+        else if (ImGui::Button("Render")) {
+            renderer.renderSpin(48, exportGif ? gifFilename : filename);
         }
         ImGui::End();
 
+        const GLStats &stats = glState().lastFrame;
+        ImGui::Begin("Stats");
+        ImGui::Text("Draw calls: %llu", (unsigned long long)stats.drawCalls);
+        ImGui::Text("Triangles: %llu", (unsigned long long)stats.triangles);
+        ImGui::Text("State changes: %llu, skipped: %llu", (unsigned long long)stats.stateChanges, (unsigned long long)stats.skippedChanges);
+        ImGui::Text("Uploaded: %.1f KB", stats.bytesUploaded / 1024.0);
+        ImGui::End();
+
+        // The backend restores every GL state it changes, so the cache stays valid
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         
@@ -298,6 +302,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     {
         mouseActive = !mouseActive;
         firstMouse = true;
+        glfwSetInputMode(window, GLFW_CURSOR, mouseActive ? GLFW_CURSOR_DISABLED : GLFW_CURSOR_NORMAL);
     }
 }
 
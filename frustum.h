@@ -0,0 +1,115 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+using namespace std;
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_SSE 1
+#endif
+
+// The six clip planes of a view projection matrix (Gribb & Hartmann 2001), in whatever space the matrix
+// takes its input from. Points inside have dot(plane, vec4(p, 1)) >= 0. The planes aren't normalised,
+// which doesn't change which side a box is on.
+struct Frustum {
+    glm::vec4 planes[6];
+
+    Frustum(const glm::mat4 &viewProjection)
+    {
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; i++)
+            rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+        for (int i = 0; i < 3; i++) {
+            planes[i*2]     = rows[3] + rows[i];
+            planes[i*2 + 1] = rows[3] - rows[i];
+        }
+    }
+};
+
+// Axis aligned boxes as centres and half extents, one array per component so they can be tested four at a time
+struct BoundsTable {
+    vector<float> centreX, centreY, centreZ;
+    vector<float> extentX, extentY, extentZ;
+
+    size_t size() const { return centreX.size(); }
+
+    void resize(size_t count)
+    {
+        for (vector<float> *component : {&centreX, &centreY, &centreZ, &extentX, &extentY, &extentZ})
+            component->resize(count, 0.0f);
+    }
+
+    void set(size_t i, const glm::vec3 &boundsMin, const glm::vec3 &boundsMax)
+    {
+        glm::vec3 centre = (boundsMin + boundsMax) * 0.5f;
+        glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+        centreX[i] = centre.x; centreY[i] = centre.y; centreZ[i] = centre.z;
+        extentX[i] = extent.x; extentY[i] = extent.y; extentZ[i] = extent.z;
+    }
+};
+
+// Set visible[i] to 1 for every box that touches the frustum and 0 for the rest, returns the number visible.
+// Boxes that straddle a plane count as visible, so a few off screen ones near the corners can get through.
+size_t cullBounds(const Frustum &frustum, const BoundsTable &bounds, vector<uint8_t> &visible)
+{
+    size_t count = bounds.size();
+    visible.resize(count);
+    size_t numVisible = 0;
+    size_t i = 0;
+
+#ifdef FRUSTUM_SSE
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+    __m128 absX[6], absY[6], absZ[6];
+    for (int p = 0; p < 6; p++) {
+        const glm::vec4 &plane = frustum.planes[p];
+        planeX[p] = _mm_set1_ps(plane.x);
+        planeY[p] = _mm_set1_ps(plane.y);
+        planeZ[p] = _mm_set1_ps(plane.z);
+        planeW[p] = _mm_set1_ps(plane.w);
+        absX[p] = _mm_set1_ps(fabsf(plane.x));
+        absY[p] = _mm_set1_ps(fabsf(plane.y));
+        absZ[p] = _mm_set1_ps(fabsf(plane.z));
+    }
+    const __m128 zero = _mm_setzero_ps();
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 cx = _mm_loadu_ps(&bounds.centreX[i]), cy = _mm_loadu_ps(&bounds.centreY[i]), cz = _mm_loadu_ps(&bounds.centreZ[i]);
+        __m128 ex = _mm_loadu_ps(&bounds.extentX[i]), ey = _mm_loadu_ps(&bounds.extentY[i]), ez = _mm_loadu_ps(&bounds.extentZ[i]);
+
+        // A box is outside if even its corner furthest along a plane's normal is behind that plane
+        __m128 outside = zero;
+        for (int p = 0; p < 6; p++) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, planeX[p]), _mm_mul_ps(cy, planeY[p])),
+                                         _mm_add_ps(_mm_mul_ps(cz, planeZ[p]), planeW[p]));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, absX[p]), _mm_mul_ps(ey, absY[p])), _mm_mul_ps(ez, absZ[p]));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+        }
+
+        int mask = _mm_movemask_ps(outside);
+        for (int k = 0; k < 4; k++) {
+            visible[i + k] = !(mask & (1 << k));
+            numVisible += visible[i + k];
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++) {
+            const glm::vec4 &plane = frustum.planes[p];
+            float distance = bounds.centreX[i]*plane.x + bounds.centreY[i]*plane.y + bounds.centreZ[i]*plane.z + plane.w;
+            float radius = bounds.extentX[i]*fabsf(plane.x) + bounds.extentY[i]*fabsf(plane.y) + bounds.extentZ[i]*fabsf(plane.z);
+            inside = distance + radius >= 0.0f;
+        }
+        visible[i] = inside;
+        numVisible += inside;
+    }
+    return numVisible;
+}
+
+#endif
@@ -0,0 +1,311 @@
+#ifndef GIFWRITER_H
+#define GIFWRITER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+// Palette index used for transparent and unchanged pixels
+#define GIF_TRANSPARENT 255
+
+// Streaming animated GIF encoder.
+// Frames are quantised to a fixed 6x7x6 colour cube and only the rectangle that changed since the
+// previous frame is LZW encoded. One frame is held back so its disposal method can be chosen once
+// the next frame is known, nothing else from earlier frames is kept in memory.
+class GifWriter {
+private:
+    struct Rect {
+        unsigned int x0, y0, x1, y1; // x1/y1 are exclusive
+        bool empty() const { return x0 >= x1 || y0 >= y1; }
+    };
+
+    FILE* file = NULL;
+    unsigned int width, height;
+    unsigned int delay;
+
+    std::vector<uint8_t> canvas;  // What is on screen before the pending frame is drawn
+    std::vector<uint8_t> pending; // Full indexed image of the frame waiting to be written
+    std::vector<uint8_t> image;   // Scratch for the incoming frame
+    Rect pendingRect;
+    bool hasPending = false;
+
+    // LZW state
+    static const int LZW_TABLE_SIZE = 8192;
+    int32_t lzwKeys[LZW_TABLE_SIZE];
+    uint16_t lzwCodes[LZW_TABLE_SIZE];
+    int prefix = -1;
+    unsigned int codeSize = 9;
+    unsigned int nextCode = 258;
+    uint8_t block[255];
+    unsigned int blockSize = 0;
+    uint32_t bitBuffer = 0;
+    unsigned int bitCount = 0;
+
+public:
+    // Delay is in hundredths of a second per frame
+    GifWriter(const std::string& filename, unsigned int width, unsigned int height, unsigned int delay = 4)
+        : width(width), height(height), delay(delay)
+    {
+        file = fopen(filename.c_str(), "wb");
+        if (!file) {
+            std::cout << "ERROR::GIF::FILE_NOT_OPENED " << filename << std::endl;
+            return;
+        }
+
+        canvas.assign(width*height, GIF_TRANSPARENT);
+        pending.resize(width*height);
+        image.resize(width*height);
+
+        // Header and logical screen descriptor with a 256 entry global colour table
+        fwrite("GIF89a", 1, 6, file);
+        writeShort(width);
+        writeShort(height);
+        fputc(0xF7, file);
+        fputc(GIF_TRANSPARENT, file);
+        fputc(0, file);
+
+        // Global colour table, a 6x7x6 colour cube padded with black
+        for (unsigned int i = 0; i < 256; i++) {
+            uint8_t rgb[3] = {0, 0, 0};
+            if (i < 252) {
+                rgb[0] = (i / 42) * 255 / 5;
+                rgb[1] = ((i / 6) % 7) * 255 / 6;
+                rgb[2] = (i % 6) * 255 / 5;
+            }
+            fwrite(rgb, 1, 3, file);
+        }
+
+        // Loop forever
+        fputc(0x21, file);
+        fputc(0xFF, file);
+        fputc(11, file);
+        fwrite("NETSCAPE2.0", 1, 11, file);
+        fputc(3, file);
+        fputc(1, file);
+        writeShort(0);
+        fputc(0, file);
+    }
+
+    ~GifWriter() {
+        close();
+    }
+
+    GifWriter(const GifWriter&) = delete;
+    GifWriter& operator=(const GifWriter&) = delete;
+
+    bool isOpen() const {
+        return file != NULL;
+    }
+
+    // Add an RGBA frame, flipVertical reads the rows bottom first as returned by glReadPixels
+    void addFrame(const unsigned char* pixels, bool flipVertical = false) {
+        if (!file)
+            return;
+
+        quantise(pixels, flipVertical);
+
+        if (hasPending) {
+            // Pixels that turn transparent can only be cleared by disposing the previous frame
+            Rect clear = {width, height, 0, 0};
+            for (unsigned int y = 0; y < height; y++)
+                for (unsigned int x = 0; x < width; x++) {
+                    unsigned int i = y*width + x;
+                    if (image[i] == GIF_TRANSPARENT && pending[i] != GIF_TRANSPARENT)
+                        grow(clear, x, y);
+                }
+
+            if (clear.empty()) {
+                writePending(1);
+                canvas.swap(pending);
+            }
+            else {
+                // Enlarge the pending frame to cover them and restore it to the background afterwards
+                grow(pendingRect, clear.x0, clear.y0);
+                grow(pendingRect, clear.x1 - 1, clear.y1 - 1);
+                writePending(2);
+                canvas.swap(pending);
+                for (unsigned int y = pendingRect.y0; y < pendingRect.y1; y++)
+                    std::fill(canvas.begin() + y*width + pendingRect.x0, canvas.begin() + y*width + pendingRect.x1, GIF_TRANSPARENT);
+            }
+        }
+
+        // The new frame only needs to cover what differs from the canvas
+        pendingRect = {width, height, 0, 0};
+        for (unsigned int y = 0; y < height; y++)
+            for (unsigned int x = 0; x < width; x++)
+                if (image[y*width + x] != canvas[y*width + x])
+                    grow(pendingRect, x, y);
+        if (pendingRect.empty())
+            pendingRect = {0, 0, 1, 1};
+
+        pending.swap(image);
+        hasPending = true;
+    }
+
+    void close() {
+        if (!file)
+            return;
+        if (hasPending)
+            writePending(1);
+        hasPending = false;
+
+        fputc(0x3B, file);
+        fclose(file);
+        file = NULL;
+    }
+
+private:
+    void writeShort(unsigned int value) {
+        fputc(value & 0xFF, file);
+        fputc((value >> 8) & 0xFF, file);
+    }
+
+    static void grow(Rect& rect, unsigned int x, unsigned int y) {
+        rect.x0 = std::min(rect.x0, x);
+        rect.y0 = std::min(rect.y0, y);
+        rect.x1 = std::max(rect.x1, x + 1);
+        rect.y1 = std::max(rect.y1, y + 1);
+    }
+
+    void quantise(const unsigned char* pixels, bool flipVertical) {
+        for (unsigned int y = 0; y < height; y++) {
+            const unsigned char* row = pixels + (flipVertical ? height - 1 - y : y)*width*4;
+            uint8_t* out = &image[y*width];
+            for (unsigned int x = 0; x < width; x++) {
+                const unsigned char* p = row + x*4;
+                if (p[3] < 128) {
+                    out[x] = GIF_TRANSPARENT;
+                    continue;
+                }
+                unsigned int r = (p[0]*5 + 127) / 255;
+                unsigned int g = (p[1]*6 + 127) / 255;
+                unsigned int b = (p[2]*5 + 127) / 255;
+                out[x] = (r*7 + g)*6 + b;
+            }
+        }
+    }
+
+    void writePending(unsigned int disposal) {
+        // Graphic control extension
+        fputc(0x21, file);
+        fputc(0xF9, file);
+        fputc(4, file);
+        fputc((disposal << 2) | 1, file);
+        writeShort(delay);
+        fputc(GIF_TRANSPARENT, file);
+        fputc(0, file);
+
+        // Image descriptor
+        fputc(0x2C, file);
+        writeShort(pendingRect.x0);
+        writeShort(pendingRect.y0);
+        writeShort(pendingRect.x1 - pendingRect.x0);
+        writeShort(pendingRect.y1 - pendingRect.y0);
+        fputc(0, file);
+
+        // Pixels already on the canvas are left transparent, which keeps runs long for LZW
+        fputc(8, file);
+        lzwBegin();
+        for (unsigned int y = pendingRect.y0; y < pendingRect.y1; y++)
+            for (unsigned int x = pendingRect.x0; x < pendingRect.x1; x++) {
+                unsigned int i = y*width + x;
+                lzwAdd(pending[i] == canvas[i] ? GIF_TRANSPARENT : pending[i]);
+            }
+        lzwEnd();
+        fputc(0, file);
+    }
+
+    // LZW encoder, codes are emitted straight into 255 byte sub-blocks
+    void lzwReset() {
+        std::fill(lzwKeys, lzwKeys + LZW_TABLE_SIZE, -1);
+        codeSize = 9;
+        nextCode = 258;
+    }
+
+    void lzwBegin() {
+        bitBuffer = 0;
+        bitCount = 0;
+        blockSize = 0;
+        lzwReset();
+        writeCode(256);
+        prefix = -1;
+    }
+
+    void lzwAdd(uint8_t value) {
+        if (prefix < 0) {
+            prefix = value;
+            return;
+        }
+
+        // Look up prefix+value in the open addressed string table
+        int32_t key = (prefix << 8) | value;
+        unsigned int slot = ((unsigned int)key * 2654435761u) >> 19;
+        while (lzwKeys[slot] != -1) {
+            if (lzwKeys[slot] == key) {
+                prefix = lzwCodes[slot];
+                return;
+            }
+            slot = (slot + 1) & (LZW_TABLE_SIZE - 1);
+        }
+
+        writeCode(prefix);
+        prefix = value;
+
+        if (nextCode < 4095) {
+            lzwKeys[slot] = key;
+            lzwCodes[slot] = nextCode;
+            // The decoder widens its codes one code later than the table fills
+            if (nextCode == (1u << codeSize) && codeSize < 12)
+                codeSize++;
+            nextCode++;
+        }
+        else {
+            // Table full, start again
+            writeCode(256);
+            lzwReset();
+        }
+    }
+
+    void lzwEnd() {
+        if (prefix >= 0) {
+            writeCode(prefix);
+            // Match the entry the decoder adds after reading the last code
+            if (nextCode == (1u << codeSize) && codeSize < 12)
+                codeSize++;
+        }
+        writeCode(257);
+        if (bitCount > 0)
+            writeByte(bitBuffer & 0xFF);
+        flushBlock();
+    }
+
+    void writeCode(unsigned int code) {
+        bitBuffer |= code << bitCount;
+        bitCount += codeSize;
+        while (bitCount >= 8) {
+            writeByte(bitBuffer & 0xFF);
+            bitBuffer >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    void writeByte(uint8_t byte) {
+        block[blockSize++] = byte;
+        if (blockSize == 255)
+            flushBlock();
+    }
+
+    void flushBlock() {
+        if (blockSize == 0)
+            return;
+        fputc(blockSize, file);
+        fwrite(block, 1, blockSize, file);
+        blockSize = 0;
+    }
+};
+
+#endif
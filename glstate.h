@@ -0,0 +1,230 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <glad/glad.h>
+
+#include <cstdint>
+#include <unordered_map>
+using namespace std;
+
+// Texture units whose bindings are tracked, BATCH_TEXTURE_UNIT in mesh.h is the highest used
+#define GL_STATE_TEXTURE_UNITS 16
+
+// Work handed to the driver over one frame
+struct GLStats {
+    uint64_t drawCalls = 0;
+    uint64_t stateChanges = 0;   // Program, vertex array, texture, capability and depth mask changes passed on
+    uint64_t skippedChanges = 0; // Ones dropped because the state was already set
+    uint64_t triangles = 0;
+    uint64_t bytesUploaded = 0;  // Buffer and texture data
+};
+
+// Cache of the GL state set through it, so that setting what is already set costs nothing. All rendering
+// binds programs, vertex arrays and textures, toggles capabilities and draws through glState(). Code that
+// changes that state behind its back must call invalidate() afterwards.
+class GLState {
+    public:
+        GLStats frame;     // Since beginFrame
+        GLStats lastFrame; // The whole previous frame, for display
+
+        GLState()
+        {
+            invalidate();
+        }
+
+        // Start counting a new frame
+        void beginFrame()
+        {
+            lastFrame = frame;
+            frame = GLStats();
+        }
+
+        // Forget everything, the next change of each kind goes to the driver
+        void invalidate()
+        {
+            program = vertexArray = activeUnit = depthWrites = UNKNOWN;
+            for (unsigned int unit = 0; unit < GL_STATE_TEXTURE_UNITS; unit++)
+                textures2D[unit] = textureArrays[unit] = UNKNOWN;
+            capabilities.clear();
+        }
+
+        void useProgram(unsigned int id)
+        {
+            if (change(program, id))
+                glUseProgram(id);
+        }
+
+        void bindVertexArray(unsigned int id)
+        {
+            if (change(vertexArray, id))
+                glBindVertexArray(id);
+        }
+
+        // Make a texture unit active, by index rather than GL_TEXTURE0 + index
+        void activeTexture(unsigned int unit)
+        {
+            if (change(activeUnit, unit))
+                glActiveTexture(GL_TEXTURE0 + unit);
+        }
+
+        // Bind a texture to a unit, only touching the active unit if the binding changes
+        void bindTexture(unsigned int unit, GLenum target, unsigned int id)
+        {
+            unsigned int *bound = binding(unit, target);
+            if (bound && *bound == id) {
+                frame.skippedChanges++;
+                return;
+            }
+            activeTexture(unit);
+            bindTexture(target, id);
+        }
+
+        // Bind a texture to whichever unit is active, for uploads
+        void bindTexture(GLenum target, unsigned int id)
+        {
+            if (activeUnit == UNKNOWN)
+                activeTexture(0);
+            unsigned int *bound = binding(activeUnit, target);
+            if (bound && *bound == id) {
+                frame.skippedChanges++;
+                return;
+            }
+            if (bound)
+                *bound = id;
+            frame.stateChanges++;
+            glBindTexture(target, id);
+        }
+
+        void enable(GLenum capability)
+        {
+            setCapability(capability, true);
+        }
+
+        void disable(GLenum capability)
+        {
+            setCapability(capability, false);
+        }
+
+        void depthMask(bool enabled)
+        {
+            if (change(depthWrites, enabled))
+                glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+        }
+
+        // Deleting a bound object unbinds it, and its name may be handed out again
+        void deleteVertexArray(unsigned int id)
+        {
+            if (vertexArray == id)
+                vertexArray = UNKNOWN;
+            glDeleteVertexArrays(1, &id);
+        }
+
+        void deleteTexture(unsigned int id)
+        {
+            for (unsigned int unit = 0; unit < GL_STATE_TEXTURE_UNITS; unit++) {
+                if (textures2D[unit] == id)
+                    textures2D[unit] = UNKNOWN;
+                if (textureArrays[unit] == id)
+                    textureArrays[unit] = UNKNOWN;
+            }
+            glDeleteTextures(1, &id);
+        }
+
+        void drawElements(GLenum mode, GLsizei count, GLenum type, const void *offset, GLsizei instances = 1)
+        {
+            if (instances == 1)
+                glDrawElements(mode, count, type, offset);
+            else
+                glDrawElementsInstanced(mode, count, type, offset, instances);
+            countDraw(mode, count, instances);
+        }
+
+        void drawArrays(GLenum mode, GLint first, GLsizei count)
+        {
+            glDrawArrays(mode, first, count);
+            countDraw(mode, count, 1);
+        }
+
+        void bufferData(GLenum target, GLsizeiptr size, const void *data, GLenum usage)
+        {
+            glBufferData(target, size, data, usage);
+            if (data)
+                frame.bytesUploaded += size;
+        }
+
+        void bufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data)
+        {
+            glBufferSubData(target, offset, size, data);
+            frame.bytesUploaded += size;
+        }
+
+        // Count data sent with calls that don't go through here, such as texture uploads
+        void uploaded(size_t bytes)
+        {
+            frame.bytesUploaded += bytes;
+        }
+
+    private:
+        static const unsigned int UNKNOWN = 0xFFFFFFFFu;
+
+        unsigned int program, vertexArray, activeUnit, depthWrites;
+        unsigned int textures2D[GL_STATE_TEXTURE_UNITS];
+        unsigned int textureArrays[GL_STATE_TEXTURE_UNITS];
+        unordered_map<GLenum, bool> capabilities;
+
+        // Record a new value, false if it was already set
+        bool change(unsigned int &current, unsigned int value)
+        {
+            if (current == value) {
+                frame.skippedChanges++;
+                return false;
+            }
+            current = value;
+            frame.stateChanges++;
+            return true;
+        }
+
+        unsigned int* binding(unsigned int unit, GLenum target)
+        {
+            if (unit >= GL_STATE_TEXTURE_UNITS)
+                return NULL;
+            if (target == GL_TEXTURE_2D)
+                return &textures2D[unit];
+            if (target == GL_TEXTURE_2D_ARRAY)
+                return &textureArrays[unit];
+            return NULL;
+        }
+
+        void setCapability(GLenum capability, bool enabled)
+        {
+            auto it = capabilities.find(capability);
+            if (it != capabilities.end() && it->second == enabled) {
+                frame.skippedChanges++;
+                return;
+            }
+            capabilities[capability] = enabled;
+            frame.stateChanges++;
+            if (enabled)
+                glEnable(capability);
+            else
+                glDisable(capability);
+        }
+
+        void countDraw(GLenum mode, GLsizei count, GLsizei instances)
+        {
+            frame.drawCalls++;
+            if (mode == GL_TRIANGLES)
+                frame.triangles += (uint64_t)(count / 3) * instances;
+            else if (mode == GL_TRIANGLE_STRIP || mode == GL_TRIANGLE_FAN)
+                frame.triangles += (uint64_t)(count > 2 ? count - 2 : 0) * instances;
+        }
+};
+
+// The state of the one GL context everything renders with
+GLState& glState()
+{
+    static GLState state;
+    return state;
+}
+
+#endif
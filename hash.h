@@ -0,0 +1,21 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ull
+
+// 64-bit FNV-1a, pass the previous result as the seed to hash data in pieces
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t seed = FNV_OFFSET_BASIS)
+{
+    const unsigned char *bytes = (const unsigned char*)data;
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+#endif
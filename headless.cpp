@@ -0,0 +1,363 @@
+#define EGL_NO_X11
+#include <glad/glad.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "shader.h"
+#include "model.h"
+#include "mesh.h"
+#include "renderer.h"
+#include "instancing.h"
+#include "vat.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <filesystem>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Headless entry point, renders stills or spins without a window using a surfaceless EGL context.
+// Usage: headless [model] [--output file] [--frames N] [--size WxH] [--threads N]
+//                 [--workers N] [--contiguous] [--overwrite] [--compress-textures] [--quantize-vertices]
+//                 [--static-batch] [--bake-vat file] [--play-vat file] [--instances N]
+
+// Camera initialisation, matches the starting view of the windowed app
+glm::vec3 cameraPos     = glm::vec3(0.0f, 0.0f,  3.0f);
+glm::vec3 cameraFront   = glm::vec3(0.0f, 0.0f, -1.0f);
+glm::vec3 cameraUp      = glm::vec3(0.0f, 1.0f,  0.0f);
+float fov = 45.0f;
+
+// Render settings
+std::string modelPath = "resources/models/space-ame-camping-amelia-watson-hololive/spaceamesketchfab2.obj";
+std::string filename = "output/test.png";
+int numFrames = 0; // 0 renders a single still
+unsigned int encoderThreads = 4;
+unsigned int RENDER_SIZE_X = 360, RENDER_SIZE_Y = 270;
+ModelOptions modelOptions;
+int numInstances = 0; // Draw this many copies of the model with instancing instead of the model once
+
+// Vertex animation baking, replaces rendering when a file is given
+std::string bakePath;
+float bakeFrameRate = 30.0f;
+
+// Vertex animation playback, the first clip of the file plays over the frames on instanced copies of the model
+std::string playPath;
+
+// Sharding settings
+int numWorkers = 1;
+bool contiguous = false; // Give each worker a block of frames instead of every Nth frame
+bool overwrite = false;  // Re-render frames that already exist on disk
+
+bool parseArguments(int argc, char** argv);
+int renderFrames(const std::vector<int>& frames);
+int coordinateWorkers(const std::vector<int>& frames);
+EGLDisplay createContext();
+void layoutInstances(InstancedModel& instanced, int count);
+
+int main(int argc, char** argv)
+{
+    if (!parseArguments(argc, argv))
+        return -1;
+
+    if (numFrames <= 0 || !bakePath.empty())
+        return renderFrames({});
+
+    bool isGif = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".gif") == 0;
+    if (isGif) {
+        if (numWorkers > 1)
+            std::cout << "GIF output is written by a single process, ignoring --workers" << std::endl;
+        std::vector<int> frames(numFrames);
+        for (int i = 0; i < numFrames; i++)
+            frames[i] = i;
+        return renderFrames(frames);
+    }
+
+    // Skip frames left over from an earlier run
+    std::vector<int> frames;
+    for (int i = 0; i < numFrames; i++)
+        if (overwrite || !std::filesystem::exists(spinFrameFilename(filename, i)))
+            frames.push_back(i);
+    if (frames.size() < (size_t)numFrames)
+        std::cout << "Resuming, " << numFrames - frames.size() << " of " << numFrames << " frames already exist" << std::endl;
+    if (frames.empty())
+        return 0;
+
+    if (numWorkers > 1)
+        return coordinateWorkers(frames);
+    return renderFrames(frames);
+}
+
+// Split the frames between worker processes, each with its own GL context, and wait for them all
+int coordinateWorkers(const std::vector<int>& frames)
+{
+    int workers = std::min<int>(numWorkers, frames.size());
+    std::vector<pid_t> children;
+
+    for (int worker = 0; worker < workers; worker++) {
+        std::vector<int> shard;
+        if (contiguous) {
+            size_t begin = frames.size() * worker / workers;
+            size_t end = frames.size() * (worker + 1) / workers;
+            shard.assign(frames.begin() + begin, frames.begin() + end);
+        }
+        else {
+            for (size_t i = worker; i < frames.size(); i += workers)
+                shard.push_back(frames[i]);
+        }
+
+        // Fork before any EGL state exists so every worker creates a clean context
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(renderFrames(shard));
+        if (pid < 0) {
+            std::cout << "ERROR::WORKER::FORK_FAILED" << std::endl;
+            break;
+        }
+        children.push_back(pid);
+    }
+
+    int failures = 0;
+    for (pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failures++;
+    }
+    if (failures > 0)
+        std::cout << "ERROR::WORKER::" << failures << " workers failed" << std::endl;
+
+    // Collect the results, anything still missing will be picked up by the next run
+    int missing = 0;
+    for (int i : frames)
+        if (!std::filesystem::exists(spinFrameFilename(filename, i)))
+            missing++;
+    if (missing > 0) {
+        std::cout << "ERROR::WORKER::" << missing << " frames missing, run again to resume" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Render a set of spin frames, or a single still if no frames are given
+int renderFrames(const std::vector<int>& frames)
+{
+    // Create an OpenGL context with no window
+    EGLDisplay display = createContext();
+    if (display == EGL_NO_DISPLAY)
+        return -1;
+
+    // Initialise GLAD
+    if(!gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+    {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        eglTerminate(display);
+        return -1;
+    }
+
+    int result = 0;
+    {
+        // Load shaders and model
+        Shader shader1("shader.vert", "shader.frag");
+        Model model(modelPath, modelOptions);
+
+        // Rigged models are drawn in their bind pose
+        Animator animator(model.nodes, model.bones, model.animations);
+        if (!model.bones.empty()) {
+            animator.play(model.animations.size());
+            animator.pose();
+            animator.bind();
+        }
+
+        VertexAnimation played;
+        if (!bakePath.empty()) {
+            VertexAnimation baked;
+            if (!bakeVertexAnimation(model, bakeFrameRate, baked) || !writeVertexAnimation(bakePath, baked))
+                result = -1;
+        }
+        else if (!playPath.empty() && !readVertexAnimation(playPath, played))
+            result = -1;
+        else if (!playPath.empty() && played.clips.empty()) {
+            std::cout << "ERROR::VAT::NO_ANIMATIONS " << playPath << std::endl;
+            result = -1;
+        }
+        else {
+            unsigned int framebufferTexture;
+            unsigned int FBO = createRenderTarget(RENDER_SIZE_X, RENDER_SIZE_Y, framebufferTexture);
+
+            // Camera transforms, also used to pick mesh LODs
+            glm::mat4 view = glm::lookAt(cameraPos, cameraPos+cameraFront, cameraUp);
+            glm::mat4 projection = glm::perspective(glm::radians(fov), (float)RENDER_SIZE_X/(float)RENDER_SIZE_Y, 0.1f, 100.0f);
+
+            Renderer renderer(shader1, model, FBO, filename, RENDER_SIZE_X, RENDER_SIZE_Y, encoderThreads);
+            renderer.setCamera(view, projection);
+
+            InstancedModel instanced(model);
+            if (numInstances > 0) {
+                layoutInstances(instanced, numInstances);
+                renderer.setInstances(instanced);
+            }
+
+            VertexAnimationTexture animation(played);
+            if (!playPath.empty()) {
+                renderer.setVertexAnimation(animation);
+
+                // Start each copy at a different point of the clip
+                const VertexAnimationClip &clip = played.clips[0];
+                for (size_t i = 0; i < instanced.instances.size(); i++)
+                    instanced.instances[i].timeOffset = clip.numFrames / clip.frameRate * i / instanced.instances.size();
+            }
+
+            if (frames.empty())
+                renderer.renderStill(filename);
+            else if ((int)frames.size() == numFrames)
+                renderer.renderSpin(numFrames, filename);
+            else
+                renderer.renderSpinFrames(numFrames, filename, frames);
+        }
+    }
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglTerminate(display);
+    return result;
+}
+
+// Lay the copies out in rows going away from the camera, spaced by the size of the model
+void layoutInstances(InstancedModel& instanced, int count)
+{
+    glm::vec3 size = instanced.model.boundsMax - instanced.model.boundsMin;
+    float spacing = 1.5f * std::max(size.x, std::max(size.y, size.z));
+    int columns = (int)std::ceil(std::sqrt((float)count));
+
+    instanced.instances.resize(count);
+    for (int i = 0; i < count; i++) {
+        glm::vec3 offset((i % columns - (columns - 1) * 0.5f) * spacing, 0.0f, -(i / columns) * spacing);
+        instanced.instances[i].transform = glm::translate(glm::mat4(1.0f), offset);
+    }
+}
+
+bool parseArguments(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--output" && hasValue)
+            filename = argv[++i];
+        else if (arg == "--frames" && hasValue)
+            numFrames = std::atoi(argv[++i]);
+        else if (arg == "--threads" && hasValue)
+            encoderThreads = std::atoi(argv[++i]);
+        else if (arg == "--workers" && hasValue)
+            numWorkers = std::atoi(argv[++i]);
+        else if (arg == "--contiguous")
+            contiguous = true;
+        else if (arg == "--overwrite")
+            overwrite = true;
+        else if (arg == "--compress-textures")
+            modelOptions.compressTextures = true;
+        else if (arg == "--quantize-vertices")
+            modelOptions.quantizeVertices = true;
+        else if (arg == "--static-batch")
+            modelOptions.staticBatch = true;
+        else if (arg == "--bake-vat" && hasValue) {
+            bakePath = argv[++i];
+            modelOptions.keepGeometry = true; // The baker reads the vertices back
+        }
+        else if (arg == "--play-vat" && hasValue) {
+            playPath = argv[++i];
+            numInstances = std::max(numInstances, 1); // Played on instanced copies
+        }
+        else if (arg == "--instances" && hasValue)
+            numInstances = std::atoi(argv[++i]);
+        else if (arg == "--size" && hasValue) {
+            if (sscanf(argv[++i], "%ux%u", &RENDER_SIZE_X, &RENDER_SIZE_Y) != 2) {
+                std::cout << "ERROR::ARGS::INVALID_SIZE " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg.rfind("--", 0) != 0)
+            modelPath = arg;
+        else {
+            std::cout << "Usage: headless [model] [--output file] [--frames N] [--size WxH] [--threads N]"
+                      << " [--workers N] [--contiguous] [--overwrite] [--compress-textures] [--quantize-vertices]"
+                      << " [--static-batch] [--bake-vat file] [--play-vat file] [--instances N]" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+EGLDisplay createContext()
+{
+    // Prefer Mesa's surfaceless platform so no display server is needed
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+        std::cout << "ERROR::EGL::INITIALISE_FAILED" << std::endl;
+        return EGL_NO_DISPLAY;
+    }
+    eglBindAPI(EGL_OPENGL_API);
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    eglChooseConfig(display, configAttribs, &config, 1, &numConfigs);
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, numConfigs > 0 ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT)
+    {
+        std::cout << "ERROR::EGL::CONTEXT_CREATION_FAILED" << std::endl;
+        eglTerminate(display);
+        return EGL_NO_DISPLAY;
+    }
+
+    // Everything is drawn into our own FBO, so fall back to a tiny pbuffer only if surfaceless is unsupported
+    EGLSurface surface = EGL_NO_SURFACE;
+    const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+    {
+        const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        surface = eglCreatePbufferSurface(display, config, pbufferAttribs);
+    }
+
+    if (!eglMakeCurrent(display, surface, surface, context))
+    {
+        std::cout << "ERROR::EGL::MAKE_CURRENT_FAILED" << std::endl;
+        eglTerminate(display);
+        return EGL_NO_DISPLAY;
+    }
+    return display;
+}
@@ -0,0 +1,98 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "shader.h"
+#include "mesh.h"
+#include "model.h"
+#include "frustum.h"
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+// Many copies of one model, drawn with a single instanced call per mesh whatever the number of copies.
+// The model is borrowed and must outlive the batch.
+class InstancedModel {
+    public:
+        Model &model;
+        vector<InstanceData> instances; // Edit freely between draws, uploaded on every draw
+
+        // Copies drawn and skipped by the last culled Draw
+        unsigned int visibleInstances = 0;
+        unsigned int culledInstances = 0;
+
+        InstancedModel(Model &model) : model(model)
+        {
+            glGenBuffers(1, &instanceBuffer);
+        }
+
+        ~InstancedModel()
+        {
+            glDeleteBuffers(1, &instanceBuffer);
+        }
+
+        InstancedModel(const InstancedModel&) = delete;
+        InstancedModel& operator=(const InstancedModel&) = delete;
+
+        // Draw every instance, each placed by its transform on top of modelMatrix
+        void Draw(Shader &shader, const glm::mat4 &modelMatrix = glm::mat4(1.0f))
+        {
+            if (instances.empty())
+                return;
+            upload(instances);
+            model.DrawInstanced(shader, instanceBuffer, instances.size(), modelMatrix);
+        }
+
+        // Draw the instances whose bounds touch the view frustum, each mesh at the LOD the nearest of them needs
+        void Draw(Shader &shader, const glm::mat4 &modelMatrix, const glm::mat4 &view, const glm::mat4 &projection, float viewportHeight)
+        {
+            bounds.resize(instances.size());
+            for (size_t i = 0; i < instances.size(); i++) {
+                glm::vec3 instanceMin, instanceMax;
+                transformBounds(instances[i].transform * modelMatrix, model.boundsMin, model.boundsMax, instanceMin, instanceMax);
+                bounds.set(i, instanceMin, instanceMax);
+            }
+            visibleInstances = cullBounds(Frustum(projection * view), bounds, visible);
+            culledInstances = instances.size() - visibleInstances;
+
+            // Pack the survivors together so they can be drawn as one range
+            compacted.clear();
+            for (size_t i = 0; i < instances.size(); i++)
+                if (visible[i])
+                    compacted.push_back(instances[i]);
+
+            if (compacted.empty())
+                return;
+            upload(compacted);
+            model.DrawInstanced(shader, instanceBuffer, compacted, modelMatrix, view, projection, viewportHeight);
+        }
+
+    private:
+        unsigned int instanceBuffer = 0;
+        size_t capacity = 0; // Instances the buffer has room for
+
+        BoundsTable bounds;
+        vector<uint8_t> visible;
+        vector<InstanceData> compacted;
+
+        void upload(const vector<InstanceData> &data)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+            if (data.size() > capacity) {
+                capacity = data.size();
+                glState().bufferData(GL_ARRAY_BUFFER, capacity * sizeof(InstanceData), data.data(), GL_STREAM_DRAW);
+            } else {
+                // Orphan the old storage so the driver doesn't wait for last frame's draws to finish with it
+                glState().bufferData(GL_ARRAY_BUFFER, capacity * sizeof(InstanceData), NULL, GL_STREAM_DRAW);
+                glState().bufferSubData(GL_ARRAY_BUFFER, 0, data.size() * sizeof(InstanceData), data.data());
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+};
+
+#endif
@@ -5,88 +5,431 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 
 #include "shader.h"
+#include "glstate.h"
 
 #include <string>
 #include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
 using namespace std;
 
 #define MAX_BONE_INFLUENCE 4
 
+// Largest simplification error, in pixels on screen, a LOD may show
+#define LOD_PIXEL_ERROR 1.0f
+
+// Texture unit static batches bind their texture array to, kept clear of the units meshes use
+#define BATCH_TEXTURE_UNIT 15
+
 struct Vertex {
     glm::vec3 Position;
     glm::vec3 Normal;
     glm::vec2 TexCoords;
 };
 
+// Compact 16 byte vertex used when a mesh is quantized, the shader dequantizes it
+struct PackedVertex {
+    uint16_t Position[4]; // Normalized within the mesh bounds, w is padding
+    int16_t  Normal[2];   // Octahedral encoded unit normal
+    uint16_t TexCoords[2]; // Half floats
+};
+
+// Bones moving a vertex of a rigged mesh, kept in its own vertex stream so unrigged meshes don't pay for it.
+// Unused slots have a weight of 0.
+struct VertexSkin {
+    uint8_t BoneIDs[MAX_BONE_INFLUENCE];
+    float   Weights[MAX_BONE_INFLUENCE];
+};
+
+// One level of detail, a range of the mesh's index buffer and how far (in model units) it strays from the full mesh
+struct MeshLod {
+    uint32_t firstIndex, numIndices;
+    float error;
+};
+
+// Per instance data of an instanced draw, read from an instance buffer at attribute locations 3 to 7 and 11
+struct InstanceData {
+    glm::mat4 transform;
+    glm::vec4 tint = glm::vec4(1.0f); // Multiplies the texture colour
+    float timeOffset = 0.0f;          // Added to the playback time of vertex animations
+};
+
+// Samplers of each type whose locations are looked up ahead, texture_diffuse1 to texture_diffuse4 and so on
+#define MATERIAL_SAMPLERS 4
+
+// Locations of the uniforms set for every mesh drawn, looked up again only when the program changes
+struct MaterialUniforms {
+    unsigned int program = 0;
+    int diffuse[MATERIAL_SAMPLERS] = {-1, -1, -1, -1}, specular[MATERIAL_SAMPLERS] = {-1, -1, -1, -1};
+    int batchTexture = -1, skinned = -1, firstVertex = -1, opacity = -1, quantized = -1;
+    int positionOffset = -1, positionScale = -1, instanced = -1;
+
+    void update(const Shader &shader)
+    {
+        if (program == shader.ID)
+            return;
+        program = shader.ID;
+
+        char name[64];
+        for (int i = 0; i < MATERIAL_SAMPLERS; i++) {
+            snprintf(name, sizeof(name), "texture_diffuse%d", i + 1);
+            diffuse[i] = shader.location(name);
+            snprintf(name, sizeof(name), "texture_specular%d", i + 1);
+            specular[i] = shader.location(name);
+        }
+        batchTexture   = shader.location("batchTexture");
+        skinned        = shader.location("skinned");
+        firstVertex    = shader.location("firstVertex");
+        opacity        = shader.location("opacity");
+        quantized      = shader.location("quantized");
+        positionOffset = shader.location("positionOffset");
+        positionScale  = shader.location("positionScale");
+        instanced      = shader.location("instanced");
+    }
+};
+
+// Point the instance attributes of the bound vertex array at an InstanceData buffer, advancing once per instance
+void bindInstanceAttributes(unsigned int instanceBuffer)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    for (int column = 0; column < 4; column++) {
+        glEnableVertexAttribArray(3 + column);
+        glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offsetof(InstanceData, transform) + column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(3 + column, 1);
+    }
+    glEnableVertexAttribArray(7);
+    glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)offsetof(InstanceData, tint));
+    glVertexAttribDivisor(7, 1);
+    glEnableVertexAttribArray(11);
+    glVertexAttribPointer(11, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)offsetof(InstanceData, timeOffset));
+    glVertexAttribDivisor(11, 1);
+}
+
+// Leave the bound vertex array as plain draws expect it, with nothing reading the instance buffer
+void unbindInstanceAttributes()
+{
+    for (unsigned int location : {3, 4, 5, 6, 7, 11}) {
+        glVertexAttribDivisor(location, 0);
+        glDisableVertexAttribArray(location);
+    }
+}
+
 struct Texture {
     unsigned int id;
     string type;
     string path;
 };
 
+// Owns its GL buffers, so it can be moved but not copied
 class Mesh {
     public:
-        vector<Vertex>          vertices;
+        vector<Vertex>          vertices; // Empty once uploaded unless keepGeometry was set
         vector<unsigned int>    indices;
         vector<Texture>         textures;
 
-        unsigned int VAO;
+        unsigned int VAO = 0;
+        unsigned int numIndices = 0;
+        GLenum indexType = GL_UNSIGNED_INT; // GL_UNSIGNED_SHORT when every index fits in 16 bits
+
+        // Quantized meshes store positions relative to their bounds: position = positionOffset + stored * positionScale
+        bool quantized = false;
+        glm::vec3 positionOffset = glm::vec3(0.0f);
+        glm::vec3 positionScale = glm::vec3(1.0f);
+
+        // Skinned meshes are posed by the bone palette in model space, so they ignore their node's transform
+        bool skinned = false;
+        vector<VertexSkin>      skin; // Empty once uploaded unless keepGeometry was set
+
+        // First vertex of this mesh in the model's flattened vertex order, vertex animation textures are laid out by it
+        unsigned int firstVertex = 0;
+
+        // Material opacity, meshes below 1 are blended after the opaque ones
+        float opacity = 1.0f;
+
+        // Bounding box and sphere of the vertices, in the mesh's own space
+        glm::vec3 boundsMin = glm::vec3(0.0f), boundsMax = glm::vec3(0.0f);
+        glm::vec3 boundsCentre = glm::vec3(0.0f);
+        float boundsRadius = 0.0f;
+        vector<MeshLod> lods; // Finest first, a single level covering all indices unless a LOD chain is set
+
+        Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, bool keepGeometry = false, bool quantize = false)
+        {
+            this->quantized = quantize;
+            this->vertices = std::move(vertices);
+            this->indices  = std::move(indices);
+            this->textures = std::move(textures);
+
+            setupMesh(this->vertices.data(), this->vertices.size(), this->indices.data(), this->indices.size());
 
-        Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+            // The GPU has its own copy now
+            if(!keepGeometry)
+            {
+                vector<Vertex>().swap(this->vertices);
+                vector<unsigned int>().swap(this->indices);
+            }
+        }
+
+        // Upload geometry straight from external memory (e.g. a mapped cache), only copying it if keepGeometry is set
+        Mesh(const Vertex *vertices, size_t numVertices, const unsigned int *indices, size_t numIndices, vector<Texture> textures, bool keepGeometry = false, bool quantize = false)
         {
-            this->vertices = vertices;
-            this->indices  = indices;
-            this->textures = textures;
+            this->quantized = quantize;
+            this->textures = std::move(textures);
+            if(keepGeometry)
+            {
+                this->vertices.assign(vertices, vertices + numVertices);
+                this->indices.assign(indices, indices + numIndices);
+            }
 
-            setupMesh();
+            setupMesh(vertices, numVertices, indices, numIndices);
         }
 
-        void Draw(Shader &shader)
+        // Use a LOD chain whose coarser levels follow the finest in the index buffer. Only the finest level is
+        // kept in indices, so code working on the CPU copy sees each triangle once.
+        void setLods(const MeshLod *chain, size_t count)
         {
-            unsigned int diffuseNr = 1;
-            unsigned int specularNr = 1;
+            lods.assign(chain, chain + count);
+            if(indices.size() > lods[0].numIndices)
+                indices.resize(lods[0].numIndices);
+        }
 
-            for(unsigned int i = 0; i < textures.size(); i++)
-            {
-                glActiveTexture(GL_TEXTURE0 + i);
+        ~Mesh()
+        {
+            releaseBuffers();
+        }
+
+        // Free the GPU copy of a mesh that is only drawn as part of something else, such as a static batch
+        void releaseBuffers()
+        {
+            if(VAO)
+                glState().deleteVertexArray(VAO);
+            if(VBO)
+                glDeleteBuffers(1, &VBO);
+            if(EBO)
+                glDeleteBuffers(1, &EBO);
+            if(skinVBO)
+                glDeleteBuffers(1, &skinVBO);
+            VAO = VBO = EBO = skinVBO = 0;
+        }
 
-                string number;
-                string name = textures[i].type;
+        Mesh(const Mesh&) = delete;
+        Mesh& operator=(const Mesh&) = delete;
 
-                if(name == "texture_diffuse")
-                    number = std::to_string(diffuseNr++);
-                else if(name == "texture_specular")
-                    number = std::to_string(specularNr++);
+        Mesh(Mesh &&other) noexcept
+        {
+            *this = std::move(other);
+        }
 
-                glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
-                glBindTexture(GL_TEXTURE_2D, textures[i].id);
+        Mesh& operator=(Mesh &&other) noexcept
+        {
+            if(this != &other)
+            {
+                std::swap(vertices, other.vertices);
+                std::swap(indices, other.indices);
+                std::swap(textures, other.textures);
+                std::swap(VAO, other.VAO);
+                std::swap(VBO, other.VBO);
+                std::swap(EBO, other.EBO);
+                std::swap(skinVBO, other.skinVBO);
+                std::swap(skinned, other.skinned);
+                std::swap(skin, other.skin);
+                std::swap(firstVertex, other.firstVertex);
+                std::swap(opacity, other.opacity);
+                std::swap(numIndices, other.numIndices);
+                std::swap(indexType, other.indexType);
+                std::swap(quantized, other.quantized);
+                std::swap(positionOffset, other.positionOffset);
+                std::swap(positionScale, other.positionScale);
+                std::swap(boundsMin, other.boundsMin);
+                std::swap(boundsMax, other.boundsMax);
+                std::swap(boundsCentre, other.boundsCentre);
+                std::swap(boundsRadius, other.boundsRadius);
+                std::swap(lods, other.lods);
             }
+            return *this;
+        }
+
+        bool transparent() const
+        {
+            return opacity < 1.0f;
+        }
+
+        // Key of the texture set the mesh binds, meshes sharing it can be drawn without rebinding
+        unsigned int materialKey() const
+        {
+            return textures.empty() ? 0 : textures[0].id;
+        }
+
+        // Coarsest level whose error stays below LOD_PIXEL_ERROR when one model unit covers pixelsPerUnit pixels
+        unsigned int selectLod(float pixelsPerUnit) const
+        {
+            unsigned int lod = 0;
+            while(lod + 1 < lods.size() && lods[lod + 1].error * pixelsPerUnit <= LOD_PIXEL_ERROR)
+                lod++;
+            return lod;
+        }
+
+        void Draw(Shader &shader, unsigned int lod = 0)
+        {
+            shader.setBool(bindMaterial(shader).instanced, false);
+
+            const MeshLod &level = lods[std::min<size_t>(lod, lods.size() - 1)];
+            glState().bindVertexArray(VAO);
+            glState().drawElements(GL_TRIANGLES, level.numIndices, indexType, (void*)(level.firstIndex * indexSize()));
+        }
+
+        // Attach bone influences, one per vertex, at attribute locations 9 and 10
+        void setSkin(const VertexSkin *skin, size_t numVertices, bool keepGeometry = false)
+        {
+            if(keepGeometry)
+                this->skin.assign(skin, skin + numVertices);
+            if(!skinVBO)
+                glGenBuffers(1, &skinVBO);
+            glState().bindVertexArray(VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, skinVBO);
+            glState().bufferData(GL_ARRAY_BUFFER, numVertices * sizeof(VertexSkin), skin, GL_STATIC_DRAW);
+
+            glEnableVertexAttribArray(9);
+            glVertexAttribIPointer(9, MAX_BONE_INFLUENCE, GL_UNSIGNED_BYTE, sizeof(VertexSkin), (void*)offsetof(VertexSkin, BoneIDs));
+            glEnableVertexAttribArray(10);
+            glVertexAttribPointer(10, MAX_BONE_INFLUENCE, GL_FLOAT, GL_FALSE, sizeof(VertexSkin), (void*)offsetof(VertexSkin, Weights));
+
+            glState().bindVertexArray(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            skinned = true;
+        }
+
+        // Draw count copies in one call, reading one InstanceData each from instanceBuffer
+        void DrawInstanced(Shader &shader, unsigned int instanceBuffer, unsigned int count, unsigned int lod = 0)
+        {
+            shader.setBool(bindMaterial(shader).instanced, true);
 
-            glBindVertexArray(VAO);
-            glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
+            // The VAO is shared between batches and plain draws, so the attributes only stay set for this draw
+            glState().bindVertexArray(VAO);
+            bindInstanceAttributes(instanceBuffer);
 
-            glBindVertexArray(0);
-            glActiveTexture(GL_TEXTURE0);
+            const MeshLod &level = lods[std::min<size_t>(lod, lods.size() - 1)];
+            glState().drawElements(GL_TRIANGLES, level.numIndices, indexType, (void*)(level.firstIndex * indexSize()), count);
+            unbindInstanceAttributes();
         }
 
     private:
-        unsigned int VBO, EBO;
+        unsigned int VBO = 0, EBO = 0, skinVBO = 0;
+
+        size_t indexSize() const
+        {
+            return indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(unsigned int);
+        }
+
+        // Bind the textures and set the vertex format uniforms, returning the locations used
+        const MaterialUniforms& bindMaterial(Shader &shader)
+        {
+            // Most frames draw every mesh with one program, so only the last one's locations are kept
+            static MaterialUniforms uniforms;
+            uniforms.update(shader);
+
+            unsigned int diffuseNr = 0;
+            unsigned int specularNr = 0;
+
+            for(unsigned int i = 0; i < textures.size(); i++)
+            {
+                const string &type = textures[i].type;
+                if(type == "texture_diffuse" && diffuseNr < MATERIAL_SAMPLERS)
+                    shader.setInt(uniforms.diffuse[diffuseNr++], i);
+                else if(type == "texture_specular" && specularNr < MATERIAL_SAMPLERS)
+                    shader.setInt(uniforms.specular[specularNr++], i);
+                else
+                {
+                    // Sampler name built on the stack, e.g. texture_diffuse5
+                    char name[64];
+                    if(type == "texture_diffuse")
+                        snprintf(name, sizeof(name), "%s%u", type.c_str(), ++diffuseNr);
+                    else if(type == "texture_specular")
+                        snprintf(name, sizeof(name), "%s%u", type.c_str(), ++specularNr);
+                    else
+                        snprintf(name, sizeof(name), "%s", type.c_str());
+                    shader.setInt(name, i);
+                }
+                glState().bindTexture(i, GL_TEXTURE_2D, textures[i].id);
+            }
+
+            // Samplers of different types may not share a unit, even unused, so keep the batch sampler on its own
+            shader.setInt(uniforms.batchTexture, BATCH_TEXTURE_UNIT);
+            shader.setBool(uniforms.skinned, skinned);
+            shader.setInt(uniforms.firstVertex, firstVertex);
+            shader.setFloat(uniforms.opacity, opacity);
+            shader.setBool(uniforms.quantized, quantized);
+            if(quantized)
+            {
+                shader.setVec3(uniforms.positionOffset, positionOffset);
+                shader.setVec3(uniforms.positionScale, positionScale);
+            }
+            return uniforms;
+        }
 
-        void setupMesh()
+        void setupMesh(const Vertex *vertices, size_t numVertices, const unsigned int *indices, size_t numIndices)
         {
+            this->numIndices = numIndices;
+            lods.assign(1, {0, (uint32_t)numIndices, 0.0f});
+
+            if(numVertices > 0)
+                boundsMin = boundsMax = vertices[0].Position;
+            for(size_t i = 1; i < numVertices; i++)
+            {
+                boundsMin = glm::min(boundsMin, vertices[i].Position);
+                boundsMax = glm::max(boundsMax, vertices[i].Position);
+            }
+            boundsCentre = (boundsMin + boundsMax) * 0.5f;
+            boundsRadius = 0.0f;
+            for(size_t i = 0; i < numVertices; i++)
+                boundsRadius = std::max(boundsRadius, glm::length(vertices[i].Position - boundsCentre));
+
             glGenVertexArrays(1, &VAO);
             glGenBuffers(1, &VBO);
             glGenBuffers(1, &EBO);
 
-            glBindVertexArray(VAO);
+            glState().bindVertexArray(VAO);
+
+            // Most meshes have few enough vertices for 16-bit indices, halving the index buffer
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+            if(numVertices <= 65536)
+            {
+                indexType = GL_UNSIGNED_SHORT;
+                vector<uint16_t> shortIndices(indices, indices + numIndices);
+                glState().bufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(uint16_t), shortIndices.data(), GL_STATIC_DRAW);
+            }
+            else
+            {
+                indexType = GL_UNSIGNED_INT;
+                glState().bufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+            }
 
             glBindBuffer(GL_ARRAY_BUFFER, VBO);
-            glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+            if(quantized)
+            {
+                vector<PackedVertex> packed = quantizeVertices(vertices, numVertices);
+                glState().bufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(PackedVertex), packed.data(), GL_STATIC_DRAW);
 
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+                // Vert Positions
+                glEnableVertexAttribArray(0);
+                glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, Position));
+
+                // Vert Normals
+                glEnableVertexAttribArray(1);
+                glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, Normal));
+
+                // Vert TexCoords
+                glEnableVertexAttribArray(2);
+                glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, TexCoords));
+
+                glState().bindVertexArray(0);
+                return;
+            }
+            glState().bufferData(GL_ARRAY_BUFFER, numVertices * sizeof(Vertex), vertices, GL_STATIC_DRAW);
 
             // Vert Positions
             glEnableVertexAttribArray(0);
@@ -100,7 +443,45 @@ class Mesh {
             glEnableVertexAttribArray(2);
             glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
 
-            glBindVertexArray(0);
+            glState().bindVertexArray(0);
+        }
+
+        // Pack vertices into the compact format and record the bounds needed to unpack them
+        vector<PackedVertex> quantizeVertices(const Vertex *vertices, size_t numVertices)
+        {
+            positionOffset = boundsMin;
+            positionScale = boundsMax - boundsMin;
+            glm::vec3 inverseScale = glm::vec3(
+                positionScale.x > 0.0f ? 1.0f / positionScale.x : 0.0f,
+                positionScale.y > 0.0f ? 1.0f / positionScale.y : 0.0f,
+                positionScale.z > 0.0f ? 1.0f / positionScale.z : 0.0f);
+
+            vector<PackedVertex> packed(numVertices);
+            for(size_t i = 0; i < numVertices; i++)
+            {
+                const Vertex &vertex = vertices[i];
+                PackedVertex &out = packed[i];
+
+                glm::vec3 position = glm::clamp((vertex.Position - positionOffset) * inverseScale, 0.0f, 1.0f);
+                for(int k = 0; k < 3; k++)
+                    out.Position[k] = (uint16_t)(position[k] * 65535.0f + 0.5f);
+                out.Position[3] = 0;
+
+                // Project onto the octahedron and fold the lower half over the upper one
+                glm::vec3 normal = vertex.Normal;
+                float length = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+                glm::vec2 encoded = length > 0.0f ? glm::vec2(normal.x, normal.y) / length : glm::vec2(0.0f);
+                if(normal.z < 0.0f)
+                    encoded = glm::vec2((1.0f - fabsf(encoded.y)) * (encoded.x >= 0.0f ? 1.0f : -1.0f),
+                                        (1.0f - fabsf(encoded.x)) * (encoded.y >= 0.0f ? 1.0f : -1.0f));
+                out.Normal[0] = (int16_t)roundf(glm::clamp(encoded.x, -1.0f, 1.0f) * 32767.0f);
+                out.Normal[1] = (int16_t)roundf(glm::clamp(encoded.y, -1.0f, 1.0f) * 32767.0f);
+
+                uint32_t texCoords = glm::packHalf2x16(vertex.TexCoords);
+                out.TexCoords[0] = texCoords & 0xFFFF;
+                out.TexCoords[1] = texCoords >> 16;
+            }
+            return packed;
         }
 };
 
@@ -0,0 +1,231 @@
+#ifndef MESHOPTIMIZE_H
+#define MESHOPTIMIZE_H
+
+#include "mesh.h"
+#include "hash.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+// Post-transform vertex cache size the optimiser targets and the statistics are measured with
+#define MESH_CACHE_SIZE 16
+
+// Average cache misses per triangle for a FIFO cache of MESH_CACHE_SIZE entries, 3.0 is the worst case
+float simulateVertexCache(const unsigned int *indices, size_t numIndices, size_t numVertices, unsigned int &misses)
+{
+    vector<unsigned int> cachedAt(numVertices, 0);
+    unsigned int time = MESH_CACHE_SIZE + 1;
+    misses = 0;
+    for (size_t i = 0; i < numIndices; i++) {
+        unsigned int v = indices[i];
+        if (time - cachedAt[v] > MESH_CACHE_SIZE) {
+            cachedAt[v] = time++;
+            misses++;
+        }
+    }
+    return numIndices ? misses / (numIndices / 3.0f) : 0.0f;
+}
+
+// Merge bitwise identical vertices and rewrite the indices to match
+void weldVertices(vector<Vertex> &vertices, vector<unsigned int> &indices)
+{
+    size_t tableSize = 1;
+    while (tableSize < vertices.size() * 2)
+        tableSize <<= 1;
+    vector<unsigned int> table(tableSize, ~0u);
+
+    vector<Vertex> welded;
+    welded.reserve(vertices.size());
+    vector<unsigned int> remap(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        size_t slot = hashBytes(&vertices[i], sizeof(Vertex)) & (tableSize - 1);
+        while (table[slot] != ~0u && memcmp(&welded[table[slot]], &vertices[i], sizeof(Vertex)) != 0)
+            slot = (slot + 1) & (tableSize - 1);
+        if (table[slot] == ~0u) {
+            table[slot] = welded.size();
+            welded.push_back(vertices[i]);
+        }
+        remap[i] = table[slot];
+    }
+
+    for (unsigned int &index : indices)
+        index = remap[index];
+    vertices.swap(welded);
+}
+
+// Tipsify (Sander et al. 2007): walk the mesh fanning around recently used vertices so triangles hit the
+// vertex cache. Returns the reordered indices, clusterStarts receives the triangle index of each point
+// where the walk had to jump, which the overdraw pass uses as boundaries.
+vector<unsigned int> optimizeVertexCache(const vector<unsigned int> &indices, size_t numVertices, vector<unsigned int> &clusterStarts)
+{
+    size_t numTriangles = indices.size() / 3;
+
+    // Triangles using each vertex
+    vector<unsigned int> live(numVertices, 0);
+    for (unsigned int index : indices)
+        live[index]++;
+    vector<unsigned int> adjacencyStart(numVertices + 1, 0);
+    for (size_t v = 0; v < numVertices; v++)
+        adjacencyStart[v + 1] = adjacencyStart[v] + live[v];
+    vector<unsigned int> adjacency(indices.size());
+    vector<unsigned int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++)
+        adjacency[fill[indices[i]]++] = i / 3;
+
+    vector<unsigned int> cachedAt(numVertices, 0);
+    vector<bool> emitted(numTriangles, false);
+    vector<unsigned int> deadEnd;
+    vector<unsigned int> candidates;
+    vector<unsigned int> output;
+    output.reserve(indices.size());
+    clusterStarts.assign(1, 0);
+
+    unsigned int time = MESH_CACHE_SIZE + 1;
+    size_t cursor = 0;
+    long fanning = numVertices ? 0 : -1;
+    size_t clusterSize = 0;
+
+    while (fanning >= 0) {
+        // Emit every remaining triangle around the fanning vertex
+        candidates.clear();
+        for (unsigned int a = adjacencyStart[fanning]; a < adjacencyStart[fanning + 1]; a++) {
+            unsigned int triangle = adjacency[a];
+            if (emitted[triangle])
+                continue;
+            emitted[triangle] = true;
+            clusterSize++;
+            for (int k = 0; k < 3; k++) {
+                unsigned int v = indices[triangle*3 + k];
+                output.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - cachedAt[v] > MESH_CACHE_SIZE)
+                    cachedAt[v] = time++;
+            }
+        }
+
+        // Next fan around the oldest cached vertex whose remaining triangles still fit in the cache
+        long next = -1;
+        int best = -1;
+        for (unsigned int v : candidates) {
+            if (live[v] == 0)
+                continue;
+            int priority = 0;
+            if (time - cachedAt[v] + 2*live[v] <= MESH_CACHE_SIZE)
+                priority = time - cachedAt[v];
+            if (priority > best) {
+                best = priority;
+                next = v;
+            }
+        }
+
+        if (next < 0) {
+            // Dead end, back up through recently emitted vertices, then fall back to scanning
+            while (!deadEnd.empty() && next < 0) {
+                unsigned int v = deadEnd.back();
+                deadEnd.pop_back();
+                if (live[v] > 0)
+                    next = v;
+            }
+            while (next < 0 && cursor < numVertices) {
+                if (live[cursor] > 0)
+                    next = cursor;
+                cursor++;
+            }
+
+            // Start a new cluster once the current one is big enough to be worth sorting on its own
+            if (next >= 0 && clusterSize >= MESH_CACHE_SIZE) {
+                clusterStarts.push_back(output.size() / 3);
+                clusterSize = 0;
+            }
+        }
+        fanning = next;
+    }
+    return output;
+}
+
+// Sort the clusters so outward facing ones are drawn first and occlude the rest, keeping each cluster's
+// triangle order intact so the vertex cache order survives
+void optimizeOverdraw(vector<unsigned int> &indices, const vector<Vertex> &vertices, const vector<unsigned int> &clusterStarts)
+{
+    size_t numTriangles = indices.size() / 3;
+    if (clusterStarts.size() < 2 || vertices.empty())
+        return;
+
+    glm::vec3 meshCentre(0.0f);
+    for (const Vertex &vertex : vertices)
+        meshCentre += vertex.Position;
+    meshCentre /= (float)vertices.size();
+
+    struct Cluster {
+        unsigned int first, count;
+        float sortKey;
+    };
+    vector<Cluster> clusters;
+    for (size_t c = 0; c < clusterStarts.size(); c++) {
+        unsigned int first = clusterStarts[c];
+        unsigned int last = c + 1 < clusterStarts.size() ? clusterStarts[c + 1] : numTriangles;
+
+        // Area weighted centre and normal of the cluster
+        glm::vec3 centre(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (unsigned int t = first; t < last; t++) {
+            const glm::vec3 &a = vertices[indices[t*3 + 0]].Position;
+            const glm::vec3 &b = vertices[indices[t*3 + 1]].Position;
+            const glm::vec3 &d = vertices[indices[t*3 + 2]].Position;
+            glm::vec3 cross = glm::cross(b - a, d - a);
+            float triangleArea = glm::length(cross);
+            centre += (a + b + d) * (triangleArea / 3.0f);
+            normal += cross;
+            area += triangleArea;
+        }
+        if (area > 0.0f)
+            centre /= area;
+        clusters.push_back({first, last - first, glm::dot(centre - meshCentre, normal)});
+    }
+
+    stable_sort(clusters.begin(), clusters.end(), [](const Cluster &a, const Cluster &b) { return a.sortKey > b.sortKey; });
+
+    vector<unsigned int> sorted;
+    sorted.reserve(indices.size());
+    for (const Cluster &cluster : clusters)
+        sorted.insert(sorted.end(), indices.begin() + cluster.first*3, indices.begin() + (cluster.first + cluster.count)*3);
+    indices.swap(sorted);
+}
+
+// Renumber vertices in the order the indices first use them, dropping unused vertices
+void optimizeVertexFetch(vector<Vertex> &vertices, vector<unsigned int> &indices)
+{
+    vector<unsigned int> remap(vertices.size(), ~0u);
+    vector<Vertex> reordered;
+    reordered.reserve(vertices.size());
+    for (unsigned int &index : indices) {
+        if (remap[index] == ~0u) {
+            remap[index] = reordered.size();
+            reordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    vertices.swap(reordered);
+}
+
+// Run every optimisation step on one triangle list
+void optimizeMesh(vector<Vertex> &vertices, vector<unsigned int> &indices)
+{
+    weldVertices(vertices, indices);
+
+    // Points and lines left over from triangulation are only welded
+    if (indices.size() % 3 == 0) {
+        vector<unsigned int> clusterStarts;
+        indices = optimizeVertexCache(indices, vertices.size(), clusterStarts);
+        optimizeOverdraw(indices, vertices, clusterStarts);
+    }
+
+    optimizeVertexFetch(vertices, indices);
+}
+
+#endif
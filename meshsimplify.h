@@ -0,0 +1,270 @@
+#ifndef MESHSIMPLIFY_H
+#define MESHSIMPLIFY_H
+
+#include "mesh.h"
+#include "meshoptimize.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+using namespace std;
+
+// LOD chain settings, levels include the full detail mesh
+#define LOD_MAX_LEVELS 5
+#define LOD_REDUCTION 0.5f   // Each level aims for this fraction of the triangles of the one before
+#define LOD_MIN_TRIANGLES 32 // Meshes this small are not simplified further
+
+// Symmetric 4x4 error quadric (Garland & Heckbert 1997), the area weighted squared distance to a set of planes
+struct Quadric {
+    double a2 = 0, ab = 0, ac = 0, ad = 0;
+    double b2 = 0, bc = 0, bd = 0;
+    double c2 = 0, cd = 0;
+    double d2 = 0;
+    double weight = 0; // Total area of the planes
+
+    void addPlane(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2)
+    {
+        glm::dvec3 normal = glm::cross(glm::dvec3(p1 - p0), glm::dvec3(p2 - p0));
+        double length = glm::length(normal);
+        if (length == 0.0)
+            return;
+        normal /= length;
+        double a = normal.x, b = normal.y, c = normal.z;
+        double d = -glm::dot(normal, glm::dvec3(p0));
+        double area = length * 0.5;
+
+        a2 += area*a*a; ab += area*a*b; ac += area*a*c; ad += area*a*d;
+        b2 += area*b*b; bc += area*b*c; bd += area*b*d;
+        c2 += area*c*c; cd += area*c*d;
+        d2 += area*d*d;
+        weight += area;
+    }
+
+    void add(const Quadric &q)
+    {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+        b2 += q.b2; bc += q.bc; bd += q.bd;
+        c2 += q.c2; cd += q.cd;
+        d2 += q.d2;
+        weight += q.weight;
+    }
+
+    double evaluate(const glm::vec3 &p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+        double error = a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x
+                     + b2*y*y + 2*bc*y*z + 2*bd*y
+                     + c2*z*z + 2*cd*z
+                     + d2;
+        return std::max(error, 0.0);
+    }
+};
+
+// Reduce a triangle list to about targetIndexCount indices by collapsing vertices onto their neighbours.
+// No vertices are created or moved, so the result indexes the same vertex buffer. Vertices on UV or normal
+// seams and on open boundaries are locked so the silhouette and texture layout survive. error receives the
+// largest RMS distance of a collapsed vertex from the surface it replaced, in model units.
+vector<unsigned int> simplifyMesh(const vector<Vertex> &vertices, const vector<unsigned int> &indices, size_t targetIndexCount, float &error)
+{
+    size_t numVertices = vertices.size();
+    error = 0.0f;
+
+    // Vertices that share a position are one point of the surface, the first of them stands for the rest
+    vector<unsigned int> positionId(numVertices);
+    vector<unsigned int> wedges(numVertices, 0);
+    {
+        size_t tableSize = 1;
+        while (tableSize < numVertices * 2)
+            tableSize <<= 1;
+        vector<unsigned int> table(tableSize, ~0u);
+        for (size_t i = 0; i < numVertices; i++) {
+            size_t slot = hashBytes(&vertices[i].Position, sizeof(glm::vec3)) & (tableSize - 1);
+            while (table[slot] != ~0u && memcmp(&vertices[table[slot]].Position, &vertices[i].Position, sizeof(glm::vec3)) != 0)
+                slot = (slot + 1) & (tableSize - 1);
+            if (table[slot] == ~0u)
+                table[slot] = i;
+            positionId[i] = table[slot];
+            wedges[table[slot]]++;
+        }
+    }
+
+    // Lock seams, then open edges, which only one triangle uses
+    vector<bool> locked(numVertices, false);
+    for (size_t i = 0; i < numVertices; i++)
+        if (wedges[positionId[i]] > 1)
+            locked[positionId[i]] = true;
+
+    unordered_map<uint64_t, unsigned int> edgeUses;
+    edgeUses.reserve(indices.size());
+    auto edgeKey = [&positionId](unsigned int a, unsigned int b) {
+        uint64_t pa = positionId[a], pb = positionId[b];
+        return pa < pb ? (pa << 32) | pb : (pb << 32) | pa;
+    };
+    for (size_t i = 0; i < indices.size(); i += 3)
+        for (int k = 0; k < 3; k++)
+            edgeUses[edgeKey(indices[i + k], indices[i + (k + 1) % 3])]++;
+    for (size_t i = 0; i < indices.size(); i += 3)
+        for (int k = 0; k < 3; k++) {
+            unsigned int a = indices[i + k], b = indices[i + (k + 1) % 3];
+            if (edgeUses[edgeKey(a, b)] == 1) {
+                locked[positionId[a]] = true;
+                locked[positionId[b]] = true;
+            }
+        }
+
+    vector<Quadric> quadrics(numVertices);
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        Quadric plane;
+        plane.addPlane(vertices[indices[i]].Position, vertices[indices[i + 1]].Position, vertices[indices[i + 2]].Position);
+        for (int k = 0; k < 3; k++)
+            quadrics[indices[i + k]].add(plane);
+    }
+
+    struct Collapse {
+        unsigned int from, to;
+        double cost;  // Area weighted, so small features go first
+        double error; // Mean squared distance to the original surface
+    };
+    vector<Collapse> collapses;
+    vector<unsigned int> adjacencyStart, adjacency;
+    vector<unsigned int> remap(numVertices);
+    vector<bool> touched(numVertices);
+    vector<unsigned int> result = indices;
+    double maxError = 0.0;
+
+    // Each pass collapses the cheapest independent edges, then rebuilds the triangle list
+    while (result.size() > targetIndexCount) {
+        collapses.clear();
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int k = 0; k < 3; k++) {
+                unsigned int a = result[i + k], b = result[i + (k + 1) % 3];
+                if (positionId[a] == positionId[b])
+                    continue;
+                if (!locked[positionId[a]]) {
+                    double cost = quadrics[a].evaluate(vertices[b].Position);
+                    collapses.push_back({a, b, cost, quadrics[a].weight > 0 ? cost / quadrics[a].weight : 0});
+                }
+                if (!locked[positionId[b]]) {
+                    double cost = quadrics[b].evaluate(vertices[a].Position);
+                    collapses.push_back({b, a, cost, quadrics[b].weight > 0 ? cost / quadrics[b].weight : 0});
+                }
+            }
+        if (collapses.empty())
+            break;
+        sort(collapses.begin(), collapses.end(), [](const Collapse &x, const Collapse &y) { return x.cost < y.cost; });
+
+        // Triangles around each vertex
+        adjacencyStart.assign(numVertices + 1, 0);
+        for (unsigned int index : result)
+            adjacencyStart[index + 1]++;
+        for (size_t v = 0; v < numVertices; v++)
+            adjacencyStart[v + 1] += adjacencyStart[v];
+        adjacency.resize(result.size());
+        vector<unsigned int> cursor(adjacencyStart.begin(), adjacencyStart.end() - 1);
+        for (size_t i = 0; i < result.size(); i++)
+            adjacency[cursor[result[i]]++] = i / 3;
+
+        for (size_t v = 0; v < numVertices; v++)
+            remap[v] = v;
+        fill(touched.begin(), touched.end(), false);
+
+        size_t trianglesToRemove = (result.size() - targetIndexCount) / 3;
+        size_t removed = 0, applied = 0;
+        for (const Collapse &collapse : collapses) {
+            if (removed >= trianglesToRemove)
+                break;
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+
+            // Reject collapses that would flip a remaining triangle or turn it on edge
+            const glm::vec3 &target = vertices[collapse.to].Position;
+            bool flips = false;
+            size_t collapsed = 0;
+            for (unsigned int a = adjacencyStart[collapse.from]; a < adjacencyStart[collapse.from + 1] && !flips; a++) {
+                const unsigned int *triangle = &result[adjacency[a]*3];
+                if (positionId[triangle[0]] == positionId[collapse.to] || positionId[triangle[1]] == positionId[collapse.to]
+                    || positionId[triangle[2]] == positionId[collapse.to]) {
+                    collapsed++;
+                    continue;
+                }
+
+                glm::vec3 before[3], after[3];
+                for (int k = 0; k < 3; k++) {
+                    before[k] = vertices[triangle[k]].Position;
+                    after[k] = triangle[k] == collapse.from ? target : before[k];
+                }
+                glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+                glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+                if (glm::dot(normalBefore, normalAfter) <= 0.25f * glm::length(normalBefore) * glm::length(normalAfter))
+                    flips = true;
+            }
+            if (flips)
+                continue;
+
+            // Keep the neighbourhood fixed for the rest of the pass so the checks above stay valid
+            for (unsigned int a = adjacencyStart[collapse.from]; a < adjacencyStart[collapse.from + 1]; a++)
+                for (int k = 0; k < 3; k++)
+                    touched[result[adjacency[a]*3 + k]] = true;
+            touched[collapse.to] = true;
+
+            remap[collapse.from] = collapse.to;
+            quadrics[collapse.to].add(quadrics[collapse.from]);
+            maxError = std::max(maxError, collapse.error);
+            removed += collapsed;
+            applied++;
+        }
+        if (applied == 0)
+            break;
+
+        // Drop triangles that collapsed to a line or a point
+        vector<unsigned int> next;
+        next.reserve(result.size());
+        for (size_t i = 0; i < result.size(); i += 3) {
+            unsigned int a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+            if (positionId[a] != positionId[b] && positionId[b] != positionId[c] && positionId[a] != positionId[c]) {
+                next.push_back(a);
+                next.push_back(b);
+                next.push_back(c);
+            }
+        }
+        result.swap(next);
+    }
+
+    error = sqrt(maxError);
+    return result;
+}
+
+// Append simplified versions of a triangle list to its indices, filling one MeshLod per level starting with the
+// original. Each level is simplified from the one before, which is cheaper than starting from the original every
+// time, so its error is bounded by the sum of the errors of the steps that led to it.
+void buildLodChain(const vector<Vertex> &vertices, vector<unsigned int> &indices, vector<MeshLod> &lods)
+{
+    lods.assign(1, {0, (uint32_t)indices.size(), 0.0f});
+    if (indices.size() % 3 != 0)
+        return;
+
+    vector<unsigned int> previous(indices);
+    float previousError = 0.0f;
+    while (lods.size() < LOD_MAX_LEVELS && previous.size() / 3 > LOD_MIN_TRIANGLES) {
+        size_t target = (size_t)(previous.size() / 3 * LOD_REDUCTION) * 3;
+        float error;
+        vector<unsigned int> level = simplifyMesh(vertices, previous, target, error);
+
+        // Stop once locked seams and boundaries keep the mesh from getting meaningfully smaller
+        if (level.empty() || level.size() > previous.size() * 3 / 4)
+            break;
+
+        vector<unsigned int> clusterStarts;
+        level = optimizeVertexCache(level, vertices.size(), clusterStarts);
+
+        previousError += error;
+        lods.push_back({(uint32_t)indices.size(), (uint32_t)level.size(), previousError});
+        indices.insert(indices.end(), level.begin(), level.end());
+        previous.swap(level);
+    }
+}
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #include <stb_image.h>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -12,11 +13,95 @@
 
 #include "shader.h"
 #include "mesh.h"
+#include "glstate.h"
+#include "modelcache.h"
+#include "workqueue.h"
+#include "texturecache.h"
+#include "texturecompress.h"
+#include "meshoptimize.h"
+#include "meshsimplify.h"
+#include "frustum.h"
+#include "staticbatch.h"
+#include "animation.h"
+#include "renderqueue.h"
+#include "hash.h"
 
 #include <string>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <climits>
 using namespace std;
 
+#define MODEL_IMPORT_FLAGS (aiProcess_Triangulate | aiProcess_FlipUVs)
+
+// Image on its way from disk to the GPU, data is owned until uploadTexture frees it
+struct TextureImage {
+    string filename;
+    string canonicalPath;
+    vector<unsigned char> file; // Encoded file contents
+    uint64_t hash = 0;
+    int width = 0, height = 0, nChannels = 0;
+    unsigned char *data = NULL;
+    CompressedImage compressed; // Used instead of data when texture compression is on
+};
+
+// Load time settings for a model
+struct ModelOptions {
+    bool compressTextures = false; // Upload textures as BC1/BC3, transcoded once and cached next to the source image
+    bool keepGeometry = false;     // Keep each mesh's vertices and indices in memory after upload, e.g. for picking
+    bool quantizeVertices = false; // Upload 16 byte packed vertices instead of 32 byte float ones
+    bool streaming = false;        // Load on a background thread, Model::update then uploads a little each frame
+    bool staticBatch = false;      // Merge meshes sharing a texture size into one draw, node transforms are baked in when loading finishes
+};
+
+// CPU side of a model ready for upload, viewing a mapped cache file or owning freshly imported data
+struct ModelGeometry {
+    unique_ptr<MappedFile> file;
+    ModelData data;
+    const Vertex *vertices = NULL;
+    const unsigned int *indices = NULL;
+    const MeshRange *meshes = NULL;
+    const MeshLod *lods = NULL;
+    const SceneNode *nodes = NULL;
+    size_t numMeshes = 0;
+    size_t numNodes = 0;
+    vector<TextureRef> textures;
+
+    // Rigged models only, these are never cached
+    vector<VertexSkin> skins;          // Parallel to vertices
+    vector<uint8_t> skinnedMeshes;     // Per mesh, 1 if it has bones
+    vector<Bone> bones;
+    vector<Animation> animations;
+};
+
+// Axis aligned bounds of a box after a transform (Arvo 1990)
+void transformBounds(const glm::mat4 &transform, const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, glm::vec3 &outMin, glm::vec3 &outMax)
+{
+    outMin = outMax = glm::vec3(transform[3]);
+    for (int column = 0; column < 3; column++)
+        for (int row = 0; row < 3; row++) {
+            float a = transform[column][row] * boundsMin[column];
+            float b = transform[column][row] * boundsMax[column];
+            outMin[row] += std::min(a, b);
+            outMax[row] += std::max(a, b);
+        }
+}
+
+bool readTexture(TextureImage &image);
+void decodeTexture(TextureImage &image);
+void transcodeTexture(TextureImage &image);
+unsigned int uploadTexture(TextureImage &image);
+void freeTextureImage(TextureImage &image);
+unsigned int placeholderTexture();
 unsigned int TextureFromFile(const char *path, const string &directory);
 
 class Model
@@ -24,178 +109,1070 @@ class Model
     public:
         vector<Texture> textures_loaded;
         vector<Mesh>    meshes;
+        vector<SceneNode> nodes;
+        vector<Bone>    bones;      // Empty unless the model is rigged
+        vector<Animation> animations;
         string          directory;
+        ModelOptions    options;
+
+        // Meshes drawn on their own and skipped by the last culled Draw, the static batch is drawn whole on top
+        unsigned int    visibleMeshes = 0;
+        unsigned int    culledMeshes = 0;
+
+        // Model space bounds of every mesh loaded so far
+        glm::vec3       boundsMin = glm::vec3(0.0f), boundsMax = glm::vec3(0.0f);
         
-        Model(string const &path)
+        Model(string const &path, ModelOptions options = ModelOptions()) : options(options)
+        {
+            if(this->options.compressTextures && !compressedTexturesSupported())
+            {
+                cout << "S3TC texture compression not supported, loading textures uncompressed" << endl;
+                this->options.compressTextures = false;
+            }
+
+            directory = path.substr(0, path.find_last_of('/'));
+            if(this->options.streaming)
+                loader = thread(&Model::streamModel, this, path);
+            else
+                loadModel(path);
+        }
+
+        ~Model()
+        {
+            if(loader.joinable())
+            {
+                cancelled = true;
+                loader.join();
+            }
+            for(StreamedTexture &texture : streamedTextures)
+            {
+                if(texture.id)
+                    TextureCache::instance().release(texture.id);
+                else
+                    freeTextureImage(texture.image);
+            }
+
+            for(const Texture &texture : textures_loaded)
+                TextureCache::instance().release(texture.id);
+            for(unsigned int id : uncachedTextures)
+                glState().deleteTexture(id);
+        }
+
+        // Textures are reference counted per model, so models can't be copied
+        Model(const Model&) = delete;
+        Model& operator=(const Model&) = delete;
+
+        // Draw every mesh at full detail, the "model" uniform is set per node from modelMatrix and the node's transform.
+        // Transparent meshes are blended after the opaque ones, in node order as there's no view to sort them by.
+        void Draw(Shader &shader, const glm::mat4 &modelMatrix = glm::mat4(1.0f))
+        {
+            if(!batch.empty())
+                drawQueue.submit(shader, batch, modelMatrix);
+            visitNodes(modelMatrix, unbatchedMeshes(), [&](Mesh &mesh, const glm::mat4 &meshMatrix)
+            {
+                drawQueue.submit(shader, mesh, meshMatrix, 0.0f);
+            });
+            drawQueue.flush();
+        }
+
+        // Draw the meshes inside the view frustum, each at the coarsest LOD that still looks the same at this
+        // viewport height, for perspective projections. Opaque meshes go front to back grouped by texture,
+        // transparent ones back to front after them.
+        void Draw(Shader &shader, const glm::mat4 &modelMatrix, const glm::mat4 &view, const glm::mat4 &projection, float viewportHeight)
+        {
+            Submit(drawQueue, shader, modelMatrix, view, projection, viewportHeight);
+            drawQueue.flush();
+        }
+
+        // Queue what the culled Draw would draw, for a queue shared with other models and flushed once
+        void Submit(RenderQueue &queue, Shader &shader, const glm::mat4 &modelMatrix, const glm::mat4 &view, const glm::mat4 &projection, float viewportHeight)
+        {
+            // The planes come out in model space, so the bounds table doesn't need transforming every frame
+            cullBounds(Frustum(projection * view * modelMatrix), meshBounds, meshVisible);
+
+            // Skinned meshes move away from their bind pose bounds, so they're always drawn
+            for(size_t m = 0; m < meshVisible.size() && m < meshes.size(); m++)
+                if(meshes[m].skinned)
+                    meshVisible[m] = 1;
+
+            // The batch is one draw, so it isn't culled or reduced, only what's left of the model is
+            if(!batch.empty())
+                queue.submit(shader, batch, modelMatrix);
+
+            visibleMeshes = culledMeshes = 0;
+            for(size_t m = 0; m < meshVisible.size(); m++)
+            {
+                if(!batch.empty() && m < batch.unbatched.size() && !batch.unbatched[m])
+                    meshVisible[m] = 0;
+                else if(meshVisible[m])
+                    visibleMeshes++;
+                else
+                    culledMeshes++;
+            }
+
+            visitNodes(modelMatrix, meshVisible.data(), [&](Mesh &mesh, const glm::mat4 &meshMatrix)
+            {
+                float depth;
+                unsigned int lod = selectLod(mesh, meshMatrix, view, projection, viewportHeight, depth);
+                queue.submit(shader, mesh, meshMatrix, depth, lod);
+            });
+        }
+
+        // Draw count copies of every mesh with one instanced call each, placed by the InstanceData in instanceBuffer.
+        // Each copy's transform is applied on top of modelMatrix and the node transforms.
+        void DrawInstanced(Shader &shader, unsigned int instanceBuffer, unsigned int count, const glm::mat4 &modelMatrix = glm::mat4(1.0f))
         {
-            loadModel(path);
+            drawBatch(shader, modelMatrix, instanceBuffer, count);
+            drawNodes(shader, modelMatrix, unbatchedMeshes(), [&](Mesh &mesh, const glm::mat4 &) { mesh.DrawInstanced(shader, instanceBuffer, count); });
         }
-        void Draw(Shader &shader)
+
+        // As above for the copies in instances, which instanceBuffer holds, with each mesh at the LOD its nearest copy
+        // needs, so no copy is drawn coarser than it would be on its own
+        void DrawInstanced(Shader &shader, unsigned int instanceBuffer, const vector<InstanceData> &instances, const glm::mat4 &modelMatrix,
+                           const glm::mat4 &view, const glm::mat4 &projection, float viewportHeight)
         {
-            for(unsigned int i = 0; i < meshes.size(); i++)
-                meshes[i].Draw(shader);
+            drawBatch(shader, modelMatrix, instanceBuffer, instances.size());
+            drawNodes(shader, modelMatrix, unbatchedMeshes(), [&](Mesh &mesh, const glm::mat4 &meshMatrix)
+            {
+                unsigned int lod = UINT_MAX;
+                float depth;
+                for(size_t i = 0; i < instances.size() && lod > 0; i++)
+                    lod = std::min(lod, selectLod(mesh, instances[i].transform * meshMatrix, view, projection, viewportHeight, depth));
+                mesh.DrawInstanced(shader, instanceBuffer, instances.size(), lod);
+            });
+        }
+
+        // Recompute world transforms and bounds after changing the local transform of any node
+        void updateTransforms()
+        {
+            meshBounds.resize(meshes.size());
+            for(size_t m = 0; m < meshes.size(); m++)
+                meshBounds.set(m, meshes[m].boundsMin, meshes[m].boundsMax);
+
+            for(SceneNode &node : nodes)
+            {
+                node.world = node.parent >= 0 ? nodes[node.parent].world * node.local : node.local;
+                node.boundsMin = glm::vec3(FLT_MAX);
+                node.boundsMax = glm::vec3(-FLT_MAX);
+            }
+
+            // Children come after their parents, so walking backwards finishes every subtree before its parent
+            for(size_t i = nodes.size(); i-- > 0;)
+            {
+                SceneNode &node = nodes[i];
+                for(size_t m = node.firstMesh; m < node.firstMesh + node.numMeshes && m < meshes.size(); m++)
+                {
+                    glm::vec3 meshMin, meshMax;
+                    transformBounds(node.world, meshes[m].boundsMin, meshes[m].boundsMax, meshMin, meshMax);
+                    meshBounds.set(m, meshMin, meshMax);
+                    node.boundsMin = glm::min(node.boundsMin, meshMin);
+                    node.boundsMax = glm::max(node.boundsMax, meshMax);
+                }
+                if(node.parent >= 0)
+                {
+                    nodes[node.parent].boundsMin = glm::min(nodes[node.parent].boundsMin, node.boundsMin);
+                    nodes[node.parent].boundsMax = glm::max(nodes[node.parent].boundsMax, node.boundsMax);
+                }
+            }
+
+            boundsMin = boundsMax = glm::vec3(0.0f);
+            for(size_t m = 0; m < meshBounds.size(); m++)
+            {
+                glm::vec3 centre(meshBounds.centreX[m], meshBounds.centreY[m], meshBounds.centreZ[m]);
+                glm::vec3 extent(meshBounds.extentX[m], meshBounds.extentY[m], meshBounds.extentZ[m]);
+                boundsMin = m ? glm::min(boundsMin, centre - extent) : centre - extent;
+                boundsMax = m ? glm::max(boundsMax, centre + extent) : centre + extent;
+            }
+        }
+
+        // Upload what the loading thread has finished, spending about budgetMs. Meshes come first with a
+        // placeholder texture, then their textures are swapped in. Returns true once everything is loaded.
+        bool update(float budgetMs = 2.0f)
+        {
+            if(loaded)
+                return true;
+
+            auto start = chrono::steady_clock::now();
+            auto withinBudget = [&]() { return chrono::duration<float, milli>(chrono::steady_clock::now() - start).count() < budgetMs; };
+
+            unique_ptr<ModelGeometry> arrived;
+            {
+                lock_guard<mutex> guard(streamLock);
+                arrived = std::move(streamedGeometry);
+            }
+            if(arrived)
+            {
+                geometry = std::move(arrived);
+                adoptScene(*geometry);
+                for(const TextureRef &ref : geometry->textures)
+                    if(!texture_index.count(ref.path))
+                        addTexture(ref, placeholderTexture());
+                meshes.reserve(geometry->numMeshes);
+            }
+
+            while(geometry && meshes.size() < geometry->numMeshes)
+            {
+                addMesh(*geometry, meshes.size());
+                if(!withinBudget())
+                {
+                    updateTransforms();
+                    return false;
+                }
+            }
+            if(geometry)
+                updateTransforms();
+            geometry.reset(); // Unmaps the cache or frees the imported data
+
+            while(true)
+            {
+                StreamedTexture texture;
+                {
+                    lock_guard<mutex> guard(streamLock);
+                    // Textures can overtake their geometry, which is only adopted at the top of the next update
+                    if(streamedTextures.empty() || streamedGeometry)
+                    {
+                        loaded = loaderDone && streamedTextures.empty() && !streamedGeometry;
+                        break;
+                    }
+                    texture = std::move(streamedTextures.front());
+                    streamedTextures.pop_front();
+                }
+                applyStreamedTexture(texture);
+                if(!withinBudget())
+                    return false;
+            }
+
+            if(loaded)
+            {
+                loader.join();
+                buildStaticBatch();
+            }
+            return loaded;
+        }
+
+        bool isLoaded() const
+        {
+            return loaded;
+        }
+
+        // Meshes merged into the static batch, which is drawn whole whenever the model is
+        unsigned int batchedMeshes() const
+        {
+            return batch.numBatched;
         }
 
     private:
-        void loadModel(string path)
+        // LOD of a mesh placed by meshMatrix, also giving the view space depth of its centre
+        unsigned int selectLod(const Mesh &mesh, const glm::mat4 &meshMatrix, const glm::mat4 &view, const glm::mat4 &projection, float viewportHeight, float &depth) const
+        {
+            float scale = std::max(glm::length(glm::vec3(meshMatrix[0])), std::max(glm::length(glm::vec3(meshMatrix[1])), glm::length(glm::vec3(meshMatrix[2]))));
+            float pixelsPerUnit = projection[1][1] * viewportHeight * 0.5f * scale; // At a distance of one unit
+            depth = -(view * meshMatrix * glm::vec4(mesh.boundsCentre, 1.0f)).z;
+            float distance = depth - mesh.boundsRadius * scale;
+            return distance > 0.0f ? mesh.selectLod(pixelsPerUnit / distance) : 0;
+        }
+
+        unordered_map<string, size_t> texture_index; // Path in the model -> textures_loaded
+        vector<unsigned int> uncachedTextures;       // Placeholders for files that couldn't be read, owned by this model
+
+        // Texture handed from the loading thread to the GL thread
+        struct StreamedTexture {
+            TextureRef ref;
+            unsigned int id = 0; // Already on the GPU and acquired, otherwise image is waiting to be uploaded
+            TextureImage image;
+        };
+
+        // Streaming state, everything after streamLock is shared with the loading thread
+        thread loader;
+        atomic<bool> cancelled{false};
+        unique_ptr<ModelGeometry> geometry; // Meshes still being created
+        bool loaded = false;
+        mutex streamLock;
+        unique_ptr<ModelGeometry> streamedGeometry;
+        deque<StreamedTexture> streamedTextures;
+        bool loaderDone = false;
+
+        // Model space bounds of each mesh placed by its node, and which of them passed the last cull
+        BoundsTable meshBounds;
+        vector<uint8_t> meshVisible;
+
+        StaticBatch batch;
+        RenderQueue drawQueue; // Reused by Draw
+
+        // Merge what the batch can take, then drop the geometry kept for it unless it was asked for
+        void buildStaticBatch()
+        {
+            if(!options.staticBatch)
+                return;
+
+            batch.build(meshes, nodes);
+            cout << "Static batch: " << batch.numBatched << " of " << meshes.size() << " meshes in one draw, "
+                 << batch.numLayers << " texture layers" << endl;
+
+            // Merged meshes are only ever drawn as part of the batch
+            for(size_t m = 0; m < meshes.size(); m++)
+                if(!batch.unbatched[m])
+                    meshes[m].releaseBuffers();
+
+            if(!options.keepGeometry)
+            {
+                for(Mesh &mesh : meshes)
+                {
+                    vector<Vertex>().swap(mesh.vertices);
+                    vector<unsigned int>().swap(mesh.indices);
+                }
+            }
+        }
+
+        // Meshes still drawn on their own, NULL for all of them, as the visible mask of drawNodes
+        const uint8_t* unbatchedMeshes() const
+        {
+            return batch.empty() ? NULL : batch.unbatched.data();
+        }
+
+        void drawBatch(Shader &shader, const glm::mat4 &modelMatrix, unsigned int instanceBuffer = 0, unsigned int count = 1)
+        {
+            if(batch.empty())
+                return;
+            shader.setMat4("model", modelMatrix);
+            batch.DrawInstanced(shader, instanceBuffer, count);
+        }
+
+        // Draw the meshes node by node, setting the "model" uniform whenever it changes.
+        // visible is indexed by mesh and may be NULL to draw everything.
+        template <typename DrawMesh>
+        void drawNodes(Shader &shader, const glm::mat4 &modelMatrix, const uint8_t *visible, DrawMesh drawMesh)
+        {
+            int modelLocation = shader.location("model");
+            glm::mat4 current;
+            bool matrixSet = false;
+            visitNodes(modelMatrix, visible, [&](Mesh &mesh, const glm::mat4 &meshMatrix)
+            {
+                if(!matrixSet || current != meshMatrix)
+                {
+                    shader.setMat4(modelLocation, meshMatrix);
+                    current = meshMatrix;
+                    matrixSet = true;
+                }
+                drawMesh(mesh, meshMatrix);
+            });
+        }
+
+        // Visit the visible meshes node by node with the matrix that places each, skinned meshes are placed by
+        // modelMatrix alone
+        template <typename VisitMesh>
+        void visitNodes(const glm::mat4 &modelMatrix, const uint8_t *visible, VisitMesh visitMesh)
+        {
+            auto isVisible = [&](size_t m) { return !visible || m >= meshBounds.size() || visible[m]; };
+
+            if(nodes.empty())
+            {
+                for(size_t m = 0; m < meshes.size(); m++)
+                    if(isVisible(m))
+                        visitMesh(meshes[m], modelMatrix);
+                return;
+            }
+
+            for(const SceneNode &node : nodes)
+            {
+                glm::mat4 nodeMatrix;
+                bool matrixSet = false;
+                for(size_t m = node.firstMesh; m < node.firstMesh + node.numMeshes && m < meshes.size(); m++)
+                {
+                    if(!isVisible(m))
+                        continue;
+                    if(meshes[m].skinned)
+                    {
+                        visitMesh(meshes[m], modelMatrix);
+                        continue;
+                    }
+                    if(!matrixSet)
+                    {
+                        nodeMatrix = modelMatrix * node.world;
+                        matrixSet = true;
+                    }
+                    visitMesh(meshes[m], nodeMatrix);
+                }
+            }
+        }
+
+        void loadModel(const string &path)
+        {
+            loaded = true;
+            ModelGeometry geometry;
+            if(readModel(path, geometry))
+            {
+                uploadMeshes(geometry);
+                buildStaticBatch();
+            }
+        }
+
+        // Loading thread: read the model, then resolve and decode its textures in parallel, handing each one over as it's ready
+        void streamModel(string path)
+        {
+            unique_ptr<ModelGeometry> model = make_unique<ModelGeometry>();
+            vector<TextureRef> refs;
+            if(readModel(path, *model))
+            {
+                unordered_set<string> seen;
+                for(const TextureRef &ref : model->textures)
+                    if(seen.insert(ref.path).second)
+                        refs.push_back(ref);
+
+                lock_guard<mutex> guard(streamLock);
+                streamedGeometry = std::move(model);
+            }
+
+            parallelFor(refs.size(), [this, &refs](size_t i)
+            {
+                if(cancelled)
+                    return;
+                StreamedTexture texture;
+                texture.ref = refs[i];
+                texture.id = prepareTexture(texture.ref, texture.image);
+
+                lock_guard<mutex> guard(streamLock);
+                streamedTextures.push_back(std::move(texture));
+            });
+
+            lock_guard<mutex> guard(streamLock);
+            loaderDone = true;
+        }
+
+        // GL thread: upload a streamed texture and point every mesh using it at the real thing
+        void applyStreamedTexture(StreamedTexture &texture)
+        {
+            unsigned int id = texture.id ? texture.id : finishTexture(texture.image);
+
+            textures_loaded[texture_index[texture.ref.path]].id = id;
+            for(Mesh &mesh : meshes)
+                for(Texture &meshTexture : mesh.textures)
+                    if(meshTexture.path == texture.ref.path)
+                        meshTexture.id = id;
+        }
+
+        // Read a model without touching GL, from its cache if that is up to date, otherwise through Assimp
+        bool readModel(const string &path, ModelGeometry &geometry)
         {
+            uint64_t sourceHash = hashModelSource(path, MODEL_IMPORT_FLAGS);
+            if (sourceHash == 0)
+            {
+                cout << "ERROR::MODEL::FILE_NOT_READ " << path << endl;
+                return false;
+            }
+
+            // Warm start, upload straight from the mapped cache
+            string cachePath = path + MODEL_CACHE_EXTENSION;
+            geometry.file = make_unique<MappedFile>(cachePath);
+            const ModelCacheHeader *header = validateModelCache(*geometry.file, sourceHash);
+            if (header)
+            {
+                readFromCache(*header, geometry);
+                return true;
+            }
+            geometry.file.reset();
+
             Assimp::Importer import;
-            const aiScene *scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
+            const aiScene *scene = import.ReadFile(path, MODEL_IMPORT_FLAGS);
             // const aiScene *scene = import.ReadFile(path, aiProcess_Triangulate);
 
             if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
             {
                 cout << "ERROR::ASSIMP::" << import.GetErrorString() << endl;
-                return;
+                return false;
             }
 
-            directory = path.substr(0, path.find_last_of('/'));
+            // Lay out every mesh in the flattened arrays first, so the conversion can fill them in parallel
+            ModelData &data = geometry.data;
+            vector<aiMesh*> sceneMeshes;
+            vector<string> nodeNames;
+            processNode(scene->mRootNode, scene, -1, sceneMeshes, data.nodes, nodeNames);
+
+            for(aiMesh *mesh : sceneMeshes)
+                processMesh(mesh, scene, data);
+            data.vertices.resize(data.meshes.empty() ? 0 : data.meshes.back().firstVertex + data.meshes.back().numVertices);
+            data.indices.resize(data.meshes.empty() ? 0 : data.meshes.back().firstIndex + data.meshes.back().numIndices);
+            parallelFor(sceneMeshes.size(), [&](size_t i) { convertMesh(sceneMeshes[i], data.meshes[i], data); });
+
+            // Reordering or simplifying would have to carry the skin along, so rigged models are loaded as they are
+            if(readSkeleton(scene, sceneMeshes, nodeNames, geometry))
+                cout << "Rigged model with " << geometry.bones.size() << " bones and " << geometry.animations.size()
+                     << " animations, not optimised or cached" << endl;
+            else
+            {
+                optimizeMeshes(data);
+                writeModelCache(cachePath, sourceHash, data);
+            }
+
+            geometry.vertices  = data.vertices.data();
+            geometry.indices   = data.indices.data();
+            geometry.meshes    = data.meshes.data();
+            geometry.lods      = data.lods.data();
+            geometry.nodes     = data.nodes.data();
+            geometry.numMeshes = data.meshes.size();
+            geometry.numNodes  = data.nodes.size();
+            geometry.textures  = data.textures;
+            return true;
+        }
+
+        void readFromCache(const ModelCacheHeader &header, ModelGeometry &geometry)
+        {
+            const unsigned char *base = geometry.file->data();
+            const ModelCacheTexture *cachedTextures = (const ModelCacheTexture*)(base + header.textureOffset);
+            const char *strings = (const char*)(base + header.stringOffset);
+
+            geometry.textures.resize(header.numTextures);
+            for(unsigned int i = 0; i < header.numTextures; i++)
+            {
+                geometry.textures[i].type.assign(strings + cachedTextures[i].typeOffset, cachedTextures[i].typeLength);
+                geometry.textures[i].path.assign(strings + cachedTextures[i].pathOffset, cachedTextures[i].pathLength);
+            }
 
-            processNode(scene->mRootNode, scene);
+            geometry.vertices  = (const Vertex*)(base + header.vertexOffset);
+            geometry.indices   = (const unsigned int*)(base + header.indexOffset);
+            geometry.meshes    = (const MeshRange*)(base + header.meshOffset);
+            geometry.lods      = (const MeshLod*)(base + header.lodOffset);
+            geometry.nodes     = (const SceneNode*)(base + header.nodeOffset);
+            geometry.numMeshes = header.numMeshes;
+            geometry.numNodes  = header.numNodes;
         }
 
-        void processNode(aiNode *node, const aiScene *scene)
+        // Take over the parts of the model that aren't per mesh
+        void adoptScene(ModelGeometry &geometry)
+        {
+            nodes.assign(geometry.nodes, geometry.nodes + geometry.numNodes);
+            bones = std::move(geometry.bones);
+            animations = std::move(geometry.animations);
+        }
+
+        // Create the GL meshes and textures for a whole model
+        void uploadMeshes(ModelGeometry &geometry)
+        {
+            loadTextures(geometry.textures);
+
+            adoptScene(geometry);
+            meshes.reserve(meshes.size() + geometry.numMeshes);
+            for(size_t i = 0; i < geometry.numMeshes; i++)
+                addMesh(geometry, i);
+            updateTransforms();
+        }
+
+        // Create one mesh, its textures must already be loaded or reserved
+        void addMesh(const ModelGeometry &geometry, size_t i)
+        {
+            const MeshRange &range = geometry.meshes[i];
+
+            vector<Texture> textures;
+            for(unsigned int j = 0; j < range.numTextures; j++)
+                textures.push_back(loadTexture(geometry.textures[range.firstTexture + j]));
+
+            meshes.emplace_back(geometry.vertices + range.firstVertex, range.numVertices, geometry.indices + range.firstIndex, range.numIndices,
+                                std::move(textures), options.keepGeometry || options.staticBatch, options.quantizeVertices);
+            meshes.back().firstVertex = range.firstVertex;
+            meshes.back().opacity = range.opacity;
+            if(range.numLods > 0)
+                meshes.back().setLods(geometry.lods + range.firstLod, range.numLods);
+            if(i < geometry.skinnedMeshes.size() && geometry.skinnedMeshes[i])
+                meshes.back().setSkin(&geometry.skins[range.firstVertex], range.numVertices, options.keepGeometry);
+        }
+
+        // Flatten the node hierarchy depth first, collecting each node's meshes in draw order
+        void processNode(aiNode *node, const aiScene *scene, int parent, vector<aiMesh*> &sceneMeshes, vector<SceneNode> &nodes, vector<string> &nodeNames)
         {   
+            SceneNode sceneNode = {};
+            sceneNode.parent    = parent;
+            sceneNode.firstMesh = sceneMeshes.size();
+            sceneNode.numMeshes = node->mNumMeshes;
+            sceneNode.local     = glm::transpose(glm::make_mat4(&node->mTransformation.a1)); // Assimp matrices are row major
+            sceneNode.world     = sceneNode.local;
+            int index = nodes.size();
+            nodes.push_back(sceneNode);
+            nodeNames.push_back(node->mName.C_Str());
+
             for(unsigned int i = 0; i < node->mNumMeshes; i++)
             {                
                 aiMesh *mesh = scene->mMeshes [node->mMeshes[i]];
-                meshes.push_back(processMesh(mesh, scene));
+                sceneMeshes.push_back(mesh);
             }
 
             for(unsigned int i = 0; i < node->mNumChildren; i++)
             {
-                processNode(node->mChildren[i], scene);
+                processNode(node->mChildren[i], scene, index, sceneMeshes, nodes, nodeNames);
             }
         }
 
-        Mesh processMesh(aiMesh *mesh, const aiScene *scene)
+        // Reserve the mesh's slice of the flattened arrays and record its textures, the geometry is filled in by convertMesh
+        void processMesh(aiMesh *mesh, const aiScene *scene, ModelData &data)
         {
-            vector<Vertex> vertices;
-            vector<unsigned int> indices;
-            vector<Texture> textures;
+            MeshRange range;
+            range.firstVertex  = data.meshes.empty() ? 0 : data.meshes.back().firstVertex + data.meshes.back().numVertices;
+            range.numVertices  = mesh->mNumVertices;
+            range.firstIndex   = data.meshes.empty() ? 0 : data.meshes.back().firstIndex + data.meshes.back().numIndices;
+            range.numIndices   = 0;
+            range.firstTexture = data.textures.size();
+            range.firstLod     = 0;
+            range.numLods      = 0;
+
+            for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+                range.numIndices += mesh->mFaces[i].mNumIndices;
+
+            if(mesh->mMaterialIndex >= 0)
+            {
+                aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
+
+                loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", data.textures);
+                loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular", data.textures);
+                material->Get(AI_MATKEY_OPACITY, range.opacity);
+            }
+            range.numTextures = data.textures.size() - range.firstTexture;
 
+            data.meshes.push_back(range);
+        }
+
+        // Convert one mesh into its preallocated slice, safe to run for several meshes at once
+        static void convertMesh(const aiMesh *mesh, const MeshRange &range, ModelData &data)
+        {
+            Vertex *vertices = &data.vertices[range.firstVertex];
             for(unsigned int i = 0; i < mesh->mNumVertices; i++)
             {   
-                Vertex vertex;
-                glm::vec3 vector;
+                Vertex &vertex = vertices[i];
                 
-                vector.x = mesh->mVertices[i].x;
-                vector.y = mesh->mVertices[i].y;
-                vector.z = mesh->mVertices[i].z;
-                vertex.Position = vector;
+                vertex.Position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
                 
-                vector.x = mesh->mNormals[i].x;
-                vector.y = mesh->mNormals[i].y;
-                vector.z = mesh->mNormals[i].z;
-                vertex.Normal = vector;
+                if(mesh->mNormals)
+                    vertex.Normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+                else
+                    vertex.Normal = glm::vec3(0.0f, 0.0f, 0.0f);
                 
                 if(mesh->mTextureCoords[0])
-                {   
-                    glm::vec2 vec;
-                    vec.x = mesh->mTextureCoords[0][i].x;
-                    vec.y = mesh->mTextureCoords[0][i].y;
-                    vertex.TexCoords = vec;
-                }
+                    vertex.TexCoords = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
                 else
                     vertex.TexCoords = glm::vec2(0.0f, 0.0f);
-
-                vertices.push_back(vertex);
             }
 
+            unsigned int *indices = range.numIndices ? &data.indices[range.firstIndex] : NULL;
             for(unsigned int i = 0; i < mesh->mNumFaces; i++)
             {
-                aiFace face = mesh->mFaces[i];
+                const aiFace &face = mesh->mFaces[i];
                 for(unsigned int j = 0; j < face.mNumIndices; j++)
-                    indices.push_back(face.mIndices[j]);
+                    *indices++ = face.mIndices[j];
             }
+        }
 
-            if(mesh->mMaterialIndex >= 0)
+        // Read the bones, vertex weights and animations of a rigged scene, returns false if it has no bones.
+        // Each vertex keeps its MAX_BONE_INFLUENCE heaviest weights, renormalised.
+        static bool readSkeleton(const aiScene *scene, const vector<aiMesh*> &sceneMeshes, const vector<string> &nodeNames, ModelGeometry &geometry)
+        {
+            unordered_map<string, int> nodeIndex;
+            for(size_t i = 0; i < nodeNames.size(); i++)
+                nodeIndex.emplace(nodeNames[i], i);
+            auto findNode = [&nodeIndex](const aiString &name) {
+                auto it = nodeIndex.find(name.C_Str());
+                return it == nodeIndex.end() ? -1 : it->second;
+            };
+
+            const ModelData &data = geometry.data;
+            unordered_map<string, unsigned int> boneIndex;
+            geometry.skinnedMeshes.assign(sceneMeshes.size(), 0);
+            geometry.skins.assign(data.vertices.size(), VertexSkin());
+            for(size_t i = 0; i < sceneMeshes.size(); i++)
             {
-                aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
+                const aiMesh *mesh = sceneMeshes[i];
+                const MeshRange &range = data.meshes[i];
+                for(unsigned int b = 0; b < mesh->mNumBones; b++)
+                {
+                    const aiBone *bone = mesh->mBones[b];
+                    auto it = boneIndex.find(bone->mName.C_Str());
+                    if(it == boneIndex.end())
+                    {
+                        if(geometry.bones.size() == MAX_BONES)
+                        {
+                            cout << "ERROR::ASSIMP::TOO_MANY_BONES more than " << MAX_BONES << ", loading the model unrigged" << endl;
+                            geometry.skins.clear();
+                            geometry.skinnedMeshes.clear();
+                            geometry.bones.clear();
+                            return false;
+                        }
+                        it = boneIndex.emplace(bone->mName.C_Str(), geometry.bones.size()).first;
+                        geometry.bones.push_back({findNode(bone->mName), glm::transpose(glm::make_mat4(&bone->mOffsetMatrix.a1))});
+                    }
 
-                vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-                textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-                
-                vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-                textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+                    for(unsigned int w = 0; w < bone->mNumWeights; w++)
+                    {
+                        const aiVertexWeight &weight = bone->mWeights[w];
+                        if(weight.mVertexId >= range.numVertices)
+                            continue;
+                        VertexSkin &skin = geometry.skins[range.firstVertex + weight.mVertexId];
+                        int lightest = 0;
+                        for(int k = 1; k < MAX_BONE_INFLUENCE; k++)
+                            if(skin.Weights[k] < skin.Weights[lightest])
+                                lightest = k;
+                        if(weight.mWeight > skin.Weights[lightest])
+                        {
+                            skin.BoneIDs[lightest] = it->second;
+                            skin.Weights[lightest] = weight.mWeight;
+                        }
+                    }
+                    geometry.skinnedMeshes[i] = 1;
+                }
+            }
+            if(geometry.bones.empty())
+            {
+                geometry.skins.clear();
+                geometry.skinnedMeshes.clear();
+                return false;
+            }
+
+            for(VertexSkin &skin : geometry.skins)
+            {
+                float total = 0.0f;
+                for(int k = 0; k < MAX_BONE_INFLUENCE; k++)
+                    total += skin.Weights[k];
+                if(total > 0.0f)
+                    for(int k = 0; k < MAX_BONE_INFLUENCE; k++)
+                        skin.Weights[k] /= total;
             }
 
-            return Mesh(vertices, indices, textures);
+            for(unsigned int a = 0; a < scene->mNumAnimations; a++)
+            {
+                const aiAnimation *source = scene->mAnimations[a];
+                Animation animation;
+                animation.name = source->mName.C_Str();
+                animation.duration = source->mDuration;
+                if(source->mTicksPerSecond > 0.0)
+                    animation.ticksPerSecond = source->mTicksPerSecond;
+
+                for(unsigned int c = 0; c < source->mNumChannels; c++)
+                {
+                    const aiNodeAnim *track = source->mChannels[c];
+                    AnimationChannel channel;
+                    channel.node = findNode(track->mNodeName);
+                    if(channel.node < 0)
+                        continue;
+                    for(unsigned int k = 0; k < track->mNumPositionKeys; k++)
+                    {
+                        const aiVectorKey &key = track->mPositionKeys[k];
+                        channel.positions.push_back({key.mTime, glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z)});
+                    }
+                    for(unsigned int k = 0; k < track->mNumRotationKeys; k++)
+                    {
+                        const aiQuatKey &key = track->mRotationKeys[k];
+                        channel.rotations.push_back({key.mTime, glm::quat(key.mValue.w, key.mValue.x, key.mValue.y, key.mValue.z)});
+                    }
+                    for(unsigned int k = 0; k < track->mNumScalingKeys; k++)
+                    {
+                        const aiVectorKey &key = track->mScalingKeys[k];
+                        channel.scales.push_back({key.mTime, glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z)});
+                    }
+                    animation.channels.push_back(std::move(channel));
+                }
+                geometry.animations.push_back(std::move(animation));
+            }
+            return true;
         }
 
-        vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
+        // Weld and reorder each mesh for the vertex cache and less overdraw, build its LOD chain, then repack the flattened arrays
+        void optimizeMeshes(ModelData &data)
+        {
+            size_t numMeshes = data.meshes.size();
+            vector<vector<Vertex>> vertices(numMeshes);
+            vector<vector<unsigned int>> indices(numMeshes);
+            vector<vector<MeshLod>> lods(numMeshes);
+            vector<unsigned int> missesBefore(numMeshes), missesAfter(numMeshes);
+
+            parallelFor(numMeshes, [&](size_t i)
+            {
+                const MeshRange &range = data.meshes[i];
+                vertices[i].assign(data.vertices.begin() + range.firstVertex, data.vertices.begin() + range.firstVertex + range.numVertices);
+                indices[i].assign(data.indices.begin() + range.firstIndex, data.indices.begin() + range.firstIndex + range.numIndices);
+
+                simulateVertexCache(indices[i].data(), indices[i].size(), vertices[i].size(), missesBefore[i]);
+                optimizeMesh(vertices[i], indices[i]);
+                simulateVertexCache(indices[i].data(), indices[i].size(), vertices[i].size(), missesAfter[i]);
+
+                buildLodChain(vertices[i], indices[i], lods[i]);
+            });
+
+            size_t verticesBefore = data.vertices.size();
+            size_t triangles = 0, coarsestTriangles = 0, totalMissesBefore = 0, totalMissesAfter = 0;
+            data.vertices.clear();
+            data.indices.clear();
+            data.lods.clear();
+            for(size_t i = 0; i < numMeshes; i++)
+            {
+                MeshRange &range = data.meshes[i];
+                range.firstVertex = data.vertices.size();
+                range.numVertices = vertices[i].size();
+                range.firstIndex  = data.indices.size();
+                range.numIndices  = indices[i].size();
+                data.vertices.insert(data.vertices.end(), vertices[i].begin(), vertices[i].end());
+                data.indices.insert(data.indices.end(), indices[i].begin(), indices[i].end());
+                range.firstLod    = data.lods.size();
+                range.numLods     = lods[i].size();
+                data.lods.insert(data.lods.end(), lods[i].begin(), lods[i].end());
+
+                triangles += lods[i][0].numIndices / 3;
+                coarsestTriangles += lods[i].back().numIndices / 3;
+                totalMissesBefore += missesBefore[i];
+                totalMissesAfter += missesAfter[i];
+            }
+
+            if(triangles > 0)
+                cout << "Optimised " << numMeshes << " meshes: " << verticesBefore << " -> " << data.vertices.size() << " vertices, ACMR "
+                     << (float)totalMissesBefore / triangles << " -> " << (float)totalMissesAfter / triangles
+                     << ", coarsest LOD " << coarsestTriangles << " of " << triangles << " triangles" << endl;
+        }
+
+        void loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName, vector<TextureRef> &textures)
         {
-            vector<Texture> textures;
             for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
             {
                 aiString str;
                 mat->GetTexture(type, i, &str);
+                textures.push_back({typeName, str.C_Str()});
+            }
+        }
 
-                bool skip = false;
+        // Load every texture that isn't loaded yet, sharing textures already on the GPU through the texture cache.
+        // Files are read and decoded on a thread pool, only the uploads happen on this thread.
+        void loadTextures(const vector<TextureRef> &refs)
+        {
+            vector<TextureRef> pending;
+            for(const TextureRef &ref : refs)
+            {
+                if(texture_index.count(ref.path))
+                    continue;
+                addTexture(ref, 0); // Reserve the slot, filled in below
+                pending.push_back(ref);
+            }
 
-                for(unsigned int j = 0; j < textures_loaded.size(); j++)
-                {
-                    if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-                    {
-                        textures.push_back(textures_loaded[j]);
-                        skip = true;
-                        break;
-                    }
-                }
-                if(!skip)
-                {   
-                    Texture texture;
-                    texture.id = TextureFromFile(str.C_Str(), directory);
-                    texture.type = typeName;
-                    texture.path = str.C_Str();
-                    textures.push_back(texture);
-                    textures_loaded.push_back(texture);
-                }
+            vector<TextureImage> images(pending.size());
+            vector<unsigned int> ids(pending.size());
+            parallelFor(pending.size(), [&](size_t i) { ids[i] = prepareTexture(pending[i], images[i]); });
+
+            for(size_t i = 0; i < pending.size(); i++)
+                textures_loaded[texture_index[pending[i].path]].id = ids[i] ? ids[i] : finishTexture(images[i]);
+        }
+
+        // The two halves of loading one texture, shared by the blocking and the streaming loader.
+        // Any thread: find the texture on the GPU already by path or contents and return it acquired,
+        // otherwise read and decode it into image and return 0.
+        unsigned int prepareTexture(const TextureRef &ref, TextureImage &image)
+        {
+            TextureCache &cache = TextureCache::instance();
+
+            error_code error;
+            image.filename = directory + '/' + ref.path;
+            image.canonicalPath = filesystem::weakly_canonical(image.filename, error).string();
+            if(error)
+                image.canonicalPath = image.filename;
+
+            unsigned int id = cache.acquirePath(image.canonicalPath);
+            if(id)
+                return id;
+
+            readTexture(image);
+            if(image.hash && (id = cache.acquireContent(image.hash, image.canonicalPath)))
+            {
+                vector<unsigned char>().swap(image.file);
+                return id;
+            }
+
+            if(options.compressTextures)
+                transcodeTexture(image);
+            else
+                decodeTexture(image);
+            return 0;
+        }
+
+        // GL thread: upload a prepared image, unless a texture with the same contents was uploaded meanwhile
+        // by another model or another file of this one
+        unsigned int finishTexture(TextureImage &image)
+        {
+            unsigned int id = 0;
+            if(image.hash && (id = TextureCache::instance().acquireContent(image.hash, image.canonicalPath)))
+            {
+                freeTextureImage(image);
+                return id;
             }
-            return textures;
+            return uploadCachedTexture(image);
+        }
+
+        // Upload a decoded image and share it through the texture cache. Files that couldn't be read aren't shared,
+        // their placeholder belongs to this model.
+        unsigned int uploadCachedTexture(TextureImage &image)
+        {
+            unsigned int id = uploadTexture(image);
+            if(image.hash)
+                TextureCache::instance().add(id, image.canonicalPath, image.hash);
+            else
+                uncachedTextures.push_back(id);
+            return id;
+        }
+
+        void addTexture(const TextureRef &ref, unsigned int id)
+        {
+            Texture texture;
+            texture.id = id;
+            texture.type = ref.type;
+            texture.path = ref.path;
+            texture_index[ref.path] = textures_loaded.size();
+            textures_loaded.push_back(texture);
+        }
+
+        Texture loadTexture(const TextureRef &ref)
+        {
+            auto it = texture_index.find(ref.path);
+            if(it != texture_index.end())
+                return textures_loaded[it->second];
+
+            loadTextures({ref});
+            return textures_loaded[texture_index[ref.path]];
         }
 };
 
-unsigned int TextureFromFile(const char *path, const string &directory)
+// Read an image file and hash its contents, safe to call from any thread
+bool readTexture(TextureImage &image)
+{
+    ifstream file(image.filename, ios::binary | ios::ate);
+    if (!file)
+        return false;
+    image.file.resize(file.tellg());
+    file.seekg(0);
+    file.read((char*)image.file.data(), image.file.size());
+    image.hash = hashBytes(image.file.data(), image.file.size());
+    return true;
+}
+
+// Decode the file contents into pixels and drop the encoded copy, safe to call from any thread
+void decodeTexture(TextureImage &image)
+{
+    if (!image.file.empty())
+        image.data = stbi_load_from_memory(image.file.data(), image.file.size(), &image.width, &image.height, &image.nChannels, 0);
+    vector<unsigned char>().swap(image.file);
+}
+
+// Fetch the compressed texture from its cache file, or decode and compress it and write the cache file
+void transcodeTexture(TextureImage &image)
 {
-    string filename = string(path);
-    filename = directory + '/' + filename;
+    string cachePath = image.filename + TEXTURE_CACHE_EXTENSION;
+    if (image.hash && readCompressedImage(cachePath, image.hash, image.compressed))
+    {
+        vector<unsigned char>().swap(image.file);
+        return;
+    }
+
+    decodeTexture(image);
+    if (!image.data)
+        return;
+
+    image.compressed = compressImage(image.data, image.width, image.height, image.nChannels);
+    if (image.hash && !writeCompressedImage(cachePath, image.hash, image.compressed))
+        std::cout << "ERROR::TEXTURE_CACHE::FILE_NOT_WRITTEN " << cachePath << std::endl;
+
+    stbi_image_free(image.data);
+    image.data = NULL;
+}
 
+// Create a GL texture from a decoded or compressed image and free its pixels, must be called on the GL thread
+unsigned int uploadTexture(TextureImage &image)
+{
     unsigned int textureID;
     glGenTextures(1, &textureID);
 
-    int width, height, nChannels;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nChannels, 0);
-    std::cout << "Loading texture: " << filename.c_str() << std::endl;
-    if (data)
+    std::cout << "Loading texture: " << image.filename.c_str() << std::endl;
+    if (!image.compressed.levels.empty())
+    {
+        // Upload the precomputed mip chain, no mipmaps are generated at load time
+        const CompressedImage &compressed = image.compressed;
+        glState().bindTexture(GL_TEXTURE_2D, textureID);
+        for (size_t level = 0; level < compressed.levels.size(); level++)
+        {
+            const CompressedImage::Level &info = compressed.levels[level];
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, compressed.format, info.width, info.height, 0, info.size, &compressed.data[info.offset]);
+            glState().uploaded(info.size);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, compressed.levels.size() - 1);
+
+        image.compressed = CompressedImage(); // Free image memory
+    }
+    else if (image.data)
     {
         GLenum format = GL_NONE;
-        if (nChannels == 1)
+        if (image.nChannels == 1)
             format = GL_RED;
-        else if (nChannels == 3)
+        else if (image.nChannels == 2)
+            format = GL_RG;
+        else if (image.nChannels == 3)
             format = GL_RGB;
-        else if (nChannels == 4)
+        else if (image.nChannels == 4)
             format = GL_RGBA;
     
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+        glState().bindTexture(GL_TEXTURE_2D, textureID);
+        // Rows are tightly packed, which only matches the default 4 byte alignment for RGBA
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.data);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if (format == GL_RG)
+        {
+            // Grey and alpha, sampled as (grey, grey, grey, alpha) like the compressed path
+            GLint swizzle[] = {GL_RED, GL_RED, GL_RED, GL_GREEN};
+            glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+        }
+        glState().uploaded((size_t)image.width * image.height * image.nChannels);
         glGenerateMipmap(GL_TEXTURE_2D);
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data); // Free image memory
-
-        std::cout << "Loaded into buffer " << textureID << std::endl;
+        stbi_image_free(image.data); // Free image memory
+        image.data = NULL;
     }
     else
     {
         std::cout << "Failed to load texture" << std::endl;
+        return textureID;
     }
 
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    std::cout << "Loaded into buffer " << textureID << std::endl;
+    return textureID;
+}
+
+// Free the pixels of an image that won't be uploaded
+void freeTextureImage(TextureImage &image)
+{
+    if (image.data)
+        stbi_image_free(image.data);
+    image.data = NULL;
+    image.compressed = CompressedImage();
+    vector<unsigned char>().swap(image.file);
+}
+
+// Plain grey 1x1 texture shown until a streamed texture is ready, shared by every model
+unsigned int placeholderTexture()
+{
+    static unsigned int textureID = 0;
+    if (textureID)
+        return textureID;
+
+    const unsigned char grey[4] = {128, 128, 128, 255};
+    glGenTextures(1, &textureID);
+    glState().bindTexture(GL_TEXTURE_2D, textureID);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     return textureID;
 }
 
+unsigned int TextureFromFile(const char *path, const string &directory)
+{
+    TextureImage image;
+    image.filename = directory + '/' + string(path);
+    readTexture(image);
+    decodeTexture(image);
+    return uploadTexture(image);
+}
+
 #endif
\ No newline at end of file
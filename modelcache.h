@@ -0,0 +1,321 @@
+#ifndef MODELCACHE_H
+#define MODELCACHE_H
+
+#include "mesh.h"
+#include "hash.h"
+#include "tempfile.h"
+
+#include <assimp/version.h>
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+using namespace std;
+
+// Bump whenever the layout of the cache or the data stored in it changes
+#define MODEL_CACHE_VERSION 6
+#define MODEL_CACHE_EXTENSION ".cfcache"
+
+// Texture used by a mesh, by type (e.g. "texture_diffuse") and path relative to the model
+struct TextureRef {
+    string type;
+    string path;
+};
+
+// Slice of the flattened model arrays belonging to one mesh, indices are relative to firstVertex
+struct MeshRange {
+    uint32_t firstVertex, numVertices;
+    uint32_t firstIndex, numIndices;
+    uint32_t firstTexture, numTextures;
+    uint32_t firstLod, numLods;
+    float    opacity = 1.0f; // Of the material, meshes below 1 are drawn in the transparent pass
+};
+
+// Node of the flattened scene hierarchy, parents always come before their children
+struct SceneNode {
+    int32_t   parent;               // -1 for the root
+    uint32_t  firstMesh, numMeshes; // Meshes placed by this node
+    glm::mat4 local;                // Relative to the parent
+    glm::mat4 world;                // Relative to the model, derived from local at load time
+    glm::vec3 boundsMin, boundsMax; // Model space bounds of the node's meshes and all its descendants, min > max when empty
+};
+
+// Flattened geometry of a whole model as produced by the importer
+struct ModelData {
+    vector<Vertex>       vertices;
+    vector<unsigned int> indices;
+    vector<MeshRange>    meshes;
+    vector<TextureRef>   textures;
+    vector<MeshLod>      lods;
+    vector<SceneNode>    nodes;
+};
+
+// On disk layout: header, then each section at a 16 byte aligned offset
+struct ModelCacheHeader {
+    char     magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t vertexSize;
+    uint32_t numMeshes;
+    uint64_t numVertices, numIndices, numTextures, numLods, numNodes;
+    uint64_t vertexOffset, indexOffset, meshOffset, textureOffset, lodOffset, nodeOffset, stringOffset, stringSize;
+};
+
+struct ModelCacheTexture {
+    uint32_t typeOffset, typeLength;
+    uint32_t pathOffset, pathLength;
+};
+
+// Add a whole file's contents to a hash, false if it can't be read
+bool hashFile(const string &path, uint64_t &hash)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+        return false;
+
+    vector<unsigned char> buffer(1 << 16);
+    while (file) {
+        file.read((char*)buffer.data(), buffer.size());
+        hash = hashBytes(buffer.data(), file.gcount(), hash);
+    }
+    return true;
+}
+
+// Material libraries an .obj file refers to, relative to it
+vector<string> objMaterialLibraries(const string &path)
+{
+    vector<string> libraries;
+    if (filesystem::path(path).extension() != ".obj")
+        return libraries;
+
+    ifstream file(path);
+    string line;
+    while (getline(file, line)) {
+        if (line.compare(0, 7, "mtllib ") != 0)
+            continue;
+        size_t start = line.find_first_not_of(" \t", 7);
+        size_t end = line.find_last_not_of(" \t\r");
+        if (start != string::npos)
+            libraries.push_back(line.substr(start, end + 1 - start));
+    }
+    return libraries;
+}
+
+// 64-bit FNV-1a hash of a model, its material libraries, the import settings and the Assimp version, 0 if the
+// model can't be read. Missing material libraries hash as their name, so adding one later misses the cache.
+uint64_t hashModelSource(const string &path, unsigned int importFlags)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    if (!hashFile(path, hash))
+        return 0;
+
+    filesystem::path directory = filesystem::path(path).parent_path();
+    for (const string &library : objMaterialLibraries(path))
+        if (!hashFile((directory / library).string(), hash))
+            hash = hashBytes(library.data(), library.size(), hash);
+
+    unsigned int version[3] = {aiGetVersionMajor(), aiGetVersionMinor(), aiGetVersionRevision()};
+    hash = hashBytes(version, sizeof(version), hash);
+    hash = hashBytes(&importFlags, sizeof(importFlags), hash);
+    return hash ? hash : 1;
+}
+
+// Read-only view of a whole file, memory mapped where the platform allows it
+class MappedFile {
+    private:
+        const unsigned char* bytes = NULL;
+        size_t length = 0;
+#ifdef _WIN32
+        vector<unsigned char> buffer;
+#endif
+
+    public:
+        MappedFile(const string &path)
+        {
+#ifdef _WIN32
+            ifstream file(path, ios::binary | ios::ate);
+            if (!file)
+                return;
+            buffer.resize(file.tellg());
+            file.seekg(0);
+            file.read((char*)buffer.data(), buffer.size());
+            bytes = buffer.data();
+            length = buffer.size();
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    bytes = (const unsigned char*)mapping;
+                    length = info.st_size;
+                }
+            }
+            close(fd);
+#endif
+        }
+
+        ~MappedFile()
+        {
+#ifndef _WIN32
+            if (bytes)
+                munmap((void*)bytes, length);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const unsigned char* data() const { return bytes; }
+        size_t size() const { return length; }
+};
+
+// Returns the header if the mapped cache is complete, consistent and was built from the same source, otherwise NULL
+const ModelCacheHeader* validateModelCache(const MappedFile &file, uint64_t sourceHash)
+{
+    if (file.size() < sizeof(ModelCacheHeader))
+        return NULL;
+
+    const ModelCacheHeader* header = (const ModelCacheHeader*)file.data();
+    if (memcmp(header->magic, "CFMC", 4) != 0 || header->version != MODEL_CACHE_VERSION
+        || header->sourceHash != sourceHash || header->vertexSize != sizeof(Vertex))
+        return NULL;
+
+    // Every section must be aligned and lie inside the file, checked without the sums overflowing
+    auto fits = [&file](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % 16 == 0 && offset <= file.size() && count <= (file.size() - offset) / size;
+    };
+    if (!fits(header->vertexOffset, header->numVertices, sizeof(Vertex))
+        || !fits(header->indexOffset, header->numIndices, sizeof(unsigned int))
+        || !fits(header->meshOffset, header->numMeshes, sizeof(MeshRange))
+        || !fits(header->textureOffset, header->numTextures, sizeof(ModelCacheTexture))
+        || !fits(header->lodOffset, header->numLods, sizeof(MeshLod))
+        || !fits(header->nodeOffset, header->numNodes, sizeof(SceneNode))
+        || !fits(header->stringOffset, header->stringSize, 1))
+        return NULL;
+
+    // And everything in them must point inside the other sections, a slice [first, first + count) fits a total
+    auto slice = [](uint64_t first, uint64_t count, uint64_t total) { return first <= total && count <= total - first; };
+    const unsigned char *base = file.data();
+    const unsigned int *indices = (const unsigned int*)(base + header->indexOffset);
+    const MeshRange *meshes = (const MeshRange*)(base + header->meshOffset);
+    const ModelCacheTexture *textures = (const ModelCacheTexture*)(base + header->textureOffset);
+    const MeshLod *lods = (const MeshLod*)(base + header->lodOffset);
+    const SceneNode *nodes = (const SceneNode*)(base + header->nodeOffset);
+
+    for (uint32_t i = 0; i < header->numMeshes; i++) {
+        const MeshRange &range = meshes[i];
+        if (!slice(range.firstVertex, range.numVertices, header->numVertices)
+            || !slice(range.firstIndex, range.numIndices, header->numIndices)
+            || !slice(range.firstTexture, range.numTextures, header->numTextures)
+            || !slice(range.firstLod, range.numLods, header->numLods))
+            return NULL;
+        for (uint32_t j = 0; j < range.numLods; j++)
+            if (!slice(lods[range.firstLod + j].firstIndex, lods[range.firstLod + j].numIndices, range.numIndices))
+                return NULL;
+        for (uint32_t j = 0; j < range.numIndices; j++)
+            if (indices[range.firstIndex + j] >= range.numVertices)
+                return NULL;
+    }
+    for (uint64_t i = 0; i < header->numTextures; i++)
+        if (!slice(textures[i].typeOffset, textures[i].typeLength, header->stringSize)
+            || !slice(textures[i].pathOffset, textures[i].pathLength, header->stringSize))
+            return NULL;
+    for (uint64_t i = 0; i < header->numNodes; i++)
+        if (nodes[i].parent < -1 || nodes[i].parent >= (int64_t)i
+            || !slice(nodes[i].firstMesh, nodes[i].numMeshes, header->numMeshes))
+            return NULL;
+
+    return header;
+}
+
+// Write the flattened model next to its source, via a temporary file so readers never see half a cache
+bool writeModelCache(const string &path, uint64_t sourceHash, const ModelData &data)
+{
+    auto align = [](uint64_t offset) { return (offset + 15) & ~(uint64_t)15; };
+
+    // Pack texture strings into one block
+    string strings;
+    vector<ModelCacheTexture> textures;
+    for (const TextureRef &ref : data.textures) {
+        ModelCacheTexture texture;
+        texture.typeOffset = strings.size();
+        texture.typeLength = ref.type.size();
+        strings += ref.type;
+        texture.pathOffset = strings.size();
+        texture.pathLength = ref.path.size();
+        strings += ref.path;
+        textures.push_back(texture);
+    }
+
+    ModelCacheHeader header = {};
+    memcpy(header.magic, "CFMC", 4);
+    header.version     = MODEL_CACHE_VERSION;
+    header.sourceHash  = sourceHash;
+    header.vertexSize  = sizeof(Vertex);
+    header.numMeshes   = data.meshes.size();
+    header.numVertices = data.vertices.size();
+    header.numIndices  = data.indices.size();
+    header.numTextures = textures.size();
+    header.numLods     = data.lods.size();
+    header.numNodes    = data.nodes.size();
+
+    header.vertexOffset  = align(sizeof(ModelCacheHeader));
+    header.indexOffset   = align(header.vertexOffset + data.vertices.size() * sizeof(Vertex));
+    header.meshOffset    = align(header.indexOffset + data.indices.size() * sizeof(unsigned int));
+    header.textureOffset = align(header.meshOffset + data.meshes.size() * sizeof(MeshRange));
+    header.lodOffset     = align(header.textureOffset + textures.size() * sizeof(ModelCacheTexture));
+    header.nodeOffset    = align(header.lodOffset + data.lods.size() * sizeof(MeshLod));
+    header.stringOffset  = align(header.nodeOffset + data.nodes.size() * sizeof(SceneNode));
+    header.stringSize    = strings.size();
+
+    // Headless workers may all miss the cache and write it at once
+    string tempPath = tempFilePath(path);
+    ofstream file(tempPath, ios::binary);
+    if (!file) {
+        cout << "ERROR::MODEL_CACHE::FILE_NOT_WRITTEN " << path << endl;
+        return false;
+    }
+
+    auto writeAt = [&file](uint64_t offset, const void* bytes, size_t size) {
+        static const char zeros[16] = {};
+        while ((uint64_t)file.tellp() < offset)
+            file.write(zeros, std::min<uint64_t>(16, offset - file.tellp()));
+        file.write((const char*)bytes, size);
+    };
+    writeAt(0, &header, sizeof(header));
+    writeAt(header.vertexOffset, data.vertices.data(), data.vertices.size() * sizeof(Vertex));
+    writeAt(header.indexOffset, data.indices.data(), data.indices.size() * sizeof(unsigned int));
+    writeAt(header.meshOffset, data.meshes.data(), data.meshes.size() * sizeof(MeshRange));
+    writeAt(header.textureOffset, textures.data(), textures.size() * sizeof(ModelCacheTexture));
+    writeAt(header.lodOffset, data.lods.data(), data.lods.size() * sizeof(MeshLod));
+    writeAt(header.nodeOffset, data.nodes.data(), data.nodes.size() * sizeof(SceneNode));
+    writeAt(header.stringOffset, strings.data(), strings.size());
+    file.close();
+
+    error_code error;
+    if (file)
+        filesystem::rename(tempPath, path, error);
+    if (!file || error) {
+        cout << "ERROR::MODEL_CACHE::FILE_NOT_WRITTEN " << path << endl;
+        filesystem::remove(tempPath, error);
+        return false;
+    }
+    return true;
+}
+
+#endif
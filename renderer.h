@@ -3,8 +3,6 @@
 
 #include <glad/glad.h>
 
-#include <GLFW/glfw3.h>
-
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -15,12 +13,73 @@
 
 #include "shader.h"
 #include "model.h"
+#include "instancing.h"
+#include "vat.h"
+#include "workqueue.h"
+#include "gifwriter.h"
 
 #include <string>
 #include <vector>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <numeric>
+#include <filesystem>
+
+// Number of pixel buffer objects in the readback ring
+#define NUM_READBACK_BUFFERS 3
+
+// Delay between frames of exported GIFs, in hundredths of a second
+#define GIF_FRAME_DELAY 4
+
+// Create a frame buffer with an RGBA colour texture and a depth/stencil buffer at the render size
+unsigned int createRenderTarget(unsigned int width, unsigned int height, unsigned int &framebufferTexture)
+{
+    // Create and bind frame buffer object
+    unsigned int FBO;
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+
+    // Create frame buffer texture and attach to FBO
+    glGenTextures(1, &framebufferTexture);
+    glState().bindTexture(GL_TEXTURE_2D, framebufferTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, framebufferTexture, 0);
+
+    // Create render buffer
+    unsigned int RBO;
+    glGenRenderbuffers(1, &RBO);
+    glBindRenderbuffer(GL_RENDERBUFFER, RBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, RBO);
+
+    auto fboStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (fboStatus != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "ERROR::FRAMEBUFFER::" << fboStatus << std::endl;
+
+    return FBO;
+}
+
+// Filename of one frame of a spin, a four-digit counter is added before the extension
+std::string spinFrameFilename(const std::string& filename, const int frame)
+{
+    // Only the last path component is split, the extension may be empty
+    std::filesystem::path path(filename);
+    std::stringstream ss;
+    ss << path.stem().string() << std::setfill('0') << std::setw(4) << frame << path.extension().string();
+    return path.replace_filename(ss.str()).string();
+}
+
+typedef std::function<void(const std::string&, const unsigned char*)> FrameHandler;
 
 class Renderer {
 private:
@@ -30,67 +89,290 @@ private:
     unsigned int RENDER_SIZE_X;
     unsigned int RENDER_SIZE_Y;
 
+    // Camera used to pick mesh LODs, without one every mesh is drawn at full detail
+    glm::mat4 view = glm::mat4(1.0f);
+    glm::mat4 projection = glm::mat4(1.0f);
+    bool hasCamera = false;
+    CameraBuffer camera;
+
+    // Copies of the model drawn instead of the model itself, if set
+    InstancedModel* instances = nullptr;
+
+    // Baked animation played over the frames, if set
+    VertexAnimationTexture* vertexAnimation = nullptr;
+    size_t vertexAnimationClip = 0;
+
+    // Readback ring, each slot holds a frame that is still being copied off the GPU
+    struct Readback {
+        GLuint PBO = 0;
+        GLsync fence = 0;
+        std::string filename;
+        FrameHandler handler;
+    };
+    Readback readbacks[NUM_READBACK_BUFFERS];
+    unsigned int nextReadback = 0;
+
+    // Encoder threads that compress and write frames off the GL thread
+    std::unique_ptr<WorkQueue> encoders;
+
 public:
-    Renderer(Shader& shader, Model& model, GLuint FBO, std::string filename, unsigned int RENDER_SIZE_X, unsigned int RENDER_SIZE_Y)
-        : shader(shader), model(model), FBO(FBO), RENDER_SIZE_X(RENDER_SIZE_X), RENDER_SIZE_Y(RENDER_SIZE_Y) {}
+    // Called with the pixels of each frame once its fence has signalled (bottom row first)
+    FrameHandler onFrameReady;
+
+    Renderer(Shader& shader, Model& model, GLuint FBO, std::string filename, unsigned int RENDER_SIZE_X, unsigned int RENDER_SIZE_Y,
+             unsigned int encoderThreads = std::thread::hardware_concurrency())
+        : shader(shader), model(model), FBO(FBO), RENDER_SIZE_X(RENDER_SIZE_X), RENDER_SIZE_Y(RENDER_SIZE_Y)
+    {
+        setEncoderThreads(encoderThreads);
+
+        // Default to copying each frame out and writing it to disk on an encoder thread
+        onFrameReady = [this](const std::string& filename, const unsigned char* pixels) {
+            std::vector<unsigned char> frame(pixels, pixels + this->RENDER_SIZE_X*this->RENDER_SIZE_Y*4);
+            encoders->push([this, filename, frame = std::move(frame)]() {
+                encodeFrame(filename, frame.data());
+            });
+        };
+
+        // Allocate pixel buffers for asynchronous readback
+        for (Readback& readback : readbacks) {
+            glGenBuffers(1, &readback.PBO);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.PBO);
+            glBufferData(GL_PIXEL_PACK_BUFFER, RENDER_SIZE_X*RENDER_SIZE_Y*4, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    ~Renderer() {
+        encoders.reset();
+        for (Readback& readback : readbacks) {
+            if (readback.fence)
+                glDeleteSync(readback.fence);
+            glDeleteBuffers(1, &readback.PBO);
+        }
+    }
+
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    // Replace the encoder pool, at most two frames per thread are buffered before rendering blocks
+    void setEncoderThreads(unsigned int numThreads) {
+        if (numThreads == 0)
+            numThreads = 1;
+        encoders.reset();
+        encoders = std::make_unique<WorkQueue>(numThreads, numThreads * 2);
+    }
+
+    unsigned int getEncoderThreads() const {
+        return encoders->numThreads();
+    }
+
+    // Set the view and projection used for every frame rendered from now on
+    void setCamera(const glm::mat4& view, const glm::mat4& projection) {
+        this->view = view;
+        this->projection = projection;
+        hasCamera = true;
+    }
+
+    // Draw these copies of the model in every frame rendered from now on, each spinning in place
+    void setInstances(InstancedModel& instances) {
+        this->instances = &instances;
+    }
+
+    // Play a clip of a baked animation of the model in every frame rendered from now on, frame N shows it
+    // N frames of the clip's frame rate in
+    void setVertexAnimation(VertexAnimationTexture& animation, size_t clip = 0) {
+        vertexAnimation = &animation;
+        vertexAnimationClip = clip;
+    }
 
     void renderSpin(const int numFrames, const std::string filename) {
         
-        // Find the position of the last dot in the filename
-        size_t dotPos = filename.find_last_of(".");
-        // Split the filename into the name and extension
-        std::string name = filename.substr(0, dotPos);
-        std::string extension = filename.substr(dotPos);
+        // GIFs are streamed into a single file instead of one image per frame
+        if (filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".gif") == 0) {
+            renderSpinGif(numFrames, filename);
+            return;
+        }
+
+        std::vector<int> frames(numFrames);
+        std::iota(frames.begin(), frames.end(), 0);
+        renderSpinFrames(numFrames, filename, frames);
+    }
 
+    // Render a subset of the frames of a spin, used to split a spin between processes
+    void renderSpinFrames(const int numFrames, const std::string& filename, const std::vector<int>& frames) {
+        for (int i : frames) {
+            renderSpinFrame(i, numFrames);
+
+            // Start reading back this frame, older frames are handed off as they finish
+            queueReadback(spinFrameFilename(filename, i));
+            collectReadbacks(false);
+        }
+
+        // Wait for the frames still in flight
+        collectReadbacks(true);
+        encoders->wait();
+    }
+
+    void renderSpinGif(const int numFrames, const std::string& filename) {
+        GifWriter gif(filename, RENDER_SIZE_X, RENDER_SIZE_Y, GIF_FRAME_DELAY);
+        if (!gif.isOpen())
+            return;
+
+        // Frames have to reach the GIF in order, so they share a single encoder thread
+        WorkQueue gifEncoder(1, 2);
+        FrameHandler addFrame = [&](const std::string&, const unsigned char* pixels) {
+            std::vector<unsigned char> frame(pixels, pixels + RENDER_SIZE_X*RENDER_SIZE_Y*4);
+            gifEncoder.push([&gif, frame = std::move(frame)]() {
+                gif.addFrame(frame.data(), true);
+            });
+        };
+
+        for (int i = 0; i < numFrames; i++) {
+            renderSpinFrame(i, numFrames);
+            queueReadback(filename, addFrame);
+            collectReadbacks(false);
+        }
+
+        collectReadbacks(true);
+        gifEncoder.wait();
+        gif.close();
+    }
+
+    // Render and write a single frame from the front
+    void renderStill(const std::string& filename) {
+        renderSpinFrame(0, 1);
+        writeFrame(filename);
+    }
+
+    void renderSpinFrame(const int frame, const int numFrames) {
         // Calculate the rotation angle for each frame
         float rotationAngle = 360.0f / numFrames;
 
-        for (int i = 0; i < numFrames; i++) {
-            // Create a new stringstream
-            std::stringstream ss;
-            // Add the name, a four-digit counter, and the extension to the stringstream
-            ss << name << std::setfill('0') << std::setw(4) << i << extension;
-            // Get the new filename from the stringstream
-            std::string newFilename = ss.str();
-
-            // Rotate the model
-            glm::mat4 scene = glm::mat4(1.0f);
-            scene = glm::rotate(scene, glm::radians(i * rotationAngle), glm::vec3(0.0f, 1.0f, 0.0f));
-
-            // Render commands
-            glBindFramebuffer(GL_FRAMEBUFFER, FBO);
-            glViewport(0, 0, RENDER_SIZE_X, RENDER_SIZE_Y);
-            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            glEnable(GL_DEPTH_TEST);
-            shader.use();
-
-            // Send transforms to shader
-            int modelLoc = glGetUniformLocation(shader.ID, "model");
-            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(scene));
-
-            model.Draw(shader);
-
-            // Call the writeFrame function with the new filename
-            writeFrame(newFilename);
+        // Rotate the model
+        glm::mat4 scene = glm::mat4(1.0f);
+        scene = glm::rotate(scene, glm::radians(frame * rotationAngle), glm::vec3(0.0f, 1.0f, 0.0f));
+
+        // Render commands
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glViewport(0, 0, RENDER_SIZE_X, RENDER_SIZE_Y);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glState().enable(GL_DEPTH_TEST);
+        shader.use();
+
+        if (vertexAnimation && vertexAnimationClip < vertexAnimation->clips.size())
+            vertexAnimation->bind(shader, vertexAnimationClip, frame / vertexAnimation->clips[vertexAnimationClip].frameRate);
+
+        // Send transforms to shader, without a camera the last one set on the shared camera buffer is used
+        shader.setMat4("model", scene);
+        if (!hasCamera) {
+            if (instances)
+                instances->Draw(shader, scene);
+            else
+                model.Draw(shader, scene);
         }
+        else {
+            camera.set(view, projection);
+
+            // Pick LODs for the render size, not the window the preview is shown in
+            if (instances)
+                instances->Draw(shader, scene, view, projection, RENDER_SIZE_Y);
+            else
+                model.Draw(shader, scene, view, projection, RENDER_SIZE_Y);
+        }
+
+        if (vertexAnimation)
+            vertexAnimation->unbind(shader);
     }
 
     void writeFrame(const std::string& filename) {
-        // Create array to hold pixel data
-        unsigned char pixels[RENDER_SIZE_X*RENDER_SIZE_Y*4]; // 4 channels for RGBA
-        
-        // Bind FBO and read to array
+        queueReadback(filename);
+        collectReadbacks(true);
+        encoders->wait();
+    }
+
+    // Start an asynchronous copy of the FBO into the next pixel buffer, handled by onFrameReady unless a handler is given
+    void queueReadback(const std::string& filename, FrameHandler handler = nullptr) {
+        Readback& readback = readbacks[nextReadback];
+
+        // Ring is full, the oldest frame has to be finished before its buffer is reused
+        if (readback.fence)
+            finishReadback(readback, true);
+
         glBindFramebuffer(GL_FRAMEBUFFER, FBO);
-        glReadPixels(0, 0, RENDER_SIZE_X, RENDER_SIZE_Y, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-    
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.PBO);
+        glReadPixels(0, 0, RENDER_SIZE_X, RENDER_SIZE_Y, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        readback.filename = filename;
+        readback.handler = handler;
+        nextReadback = (nextReadback + 1) % NUM_READBACK_BUFFERS;
+    }
+
+    // Hand off finished frames in submission order, optionally blocking until all are done
+    void collectReadbacks(bool wait) {
+        for (unsigned int i = 0; i < NUM_READBACK_BUFFERS; i++) {
+            Readback& readback = readbacks[(nextReadback + i) % NUM_READBACK_BUFFERS];
+            if (!readback.fence)
+                continue;
+            if (!finishReadback(readback, wait))
+                break;
+        }
+    }
+
+private:
+    bool finishReadback(Readback& readback, bool wait) {
+        // Poll the fence, flushing so it is guaranteed to signal eventually
+        GLuint64 timeout = wait ? 1000000000 : 0;
+        GLenum result;
+        do {
+            result = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        } while (wait && result == GL_TIMEOUT_EXPIRED);
+
+        if (result == GL_TIMEOUT_EXPIRED)
+            return false;
+        if (result == GL_WAIT_FAILED)
+            std::cout << "ERROR::RENDERER::READBACK_WAIT_FAILED" << std::endl;
+
+        glDeleteSync(readback.fence);
+        readback.fence = 0;
+
+        // Map the pixel buffer and pass the frame on
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.PBO);
+        const unsigned char* pixels = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, RENDER_SIZE_X*RENDER_SIZE_Y*4, GL_MAP_READ_BIT);
+        if (!pixels) {
+            std::cout << "ERROR::RENDERER::READBACK_MAP_FAILED " << readback.filename << std::endl;
+        } else {
+            if (readback.handler)
+                readback.handler(readback.filename, pixels);
+            else
+                onFrameReady(readback.filename, pixels);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        readback.handler = nullptr;
+        return true;
+    }
+
+    void encodeFrame(const std::string& filename, const unsigned char* pixels) {
         // Calculate scanline size
         int scanlinesize = RENDER_SIZE_X*4*sizeof(char);
 
-        // Write to file using OIIO
+        // Write to a partial file using OIIO, then move it into place so interrupted renders never leave a truncated frame
+        std::filesystem::path path(filename);
+        std::string partialFilename = path.replace_filename(path.stem().string() + ".partial" + path.extension().string()).string();
         OIIO::ImageSpec spec(RENDER_SIZE_X, RENDER_SIZE_Y, 4, OIIO::TypeDesc::UINT8);
         OIIO::ImageBuf buf(spec, (char *)pixels+(RENDER_SIZE_Y -1)*scanlinesize, OIIO::AutoStride, -scanlinesize, OIIO::AutoStride);
-        buf.write(filename);
+        if (!buf.write(partialFilename)) {
+            std::cout << "ERROR::RENDERER::WRITE_FAILED " << filename << std::endl;
+            return;
+        }
+
+        std::error_code error;
+        std::filesystem::rename(partialFilename, filename, error);
+        if (error)
+            std::cout << "ERROR::RENDERER::RENAME_FAILED " << filename << std::endl;
     }
 };
 
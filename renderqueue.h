@@ -0,0 +1,179 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "shader.h"
+#include "mesh.h"
+#include "glstate.h"
+#include "staticbatch.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+enum RenderPass {
+    RENDER_PASS_OPAQUE = 0,
+    RENDER_PASS_TRANSPARENT = 1
+};
+
+// Sort key of a draw, most significant bits first:
+//   opaque:      pass (2) | shader (10) | material (20) | depth (32)
+//   transparent: pass (2) | inverted depth (32) | shader (10) | material (20)
+// Opaque draws are grouped by state and run front to back within it for early-Z, transparent draws run back
+// to front. depth is the view space distance and only needs to be ordered, negative values count as 0.
+uint64_t renderSortKey(RenderPass pass, unsigned int shader, unsigned int material, float depth)
+{
+    // Non-negative floats order the same as their bit patterns
+    uint32_t depthBits = 0;
+    if (depth > 0.0f)
+        memcpy(&depthBits, &depth, sizeof(depthBits));
+
+    uint64_t state = ((uint64_t)(shader & 0x3FF) << 20) | (material & 0xFFFFF);
+    if (pass == RENDER_PASS_OPAQUE)
+        return ((uint64_t)pass << 62) | (state << 32) | depthBits;
+    return ((uint64_t)pass << 62) | ((uint64_t)(uint32_t)~depthBits << 30) | state;
+}
+
+// One draw waiting in a queue, either a mesh or a merged static batch
+struct RenderItem {
+    uint64_t key;
+    Shader *shader;
+    Mesh *mesh;
+    StaticBatch *batch;
+    unsigned int lod;
+    glm::mat4 transform; // The "model" uniform
+};
+
+// Draws collected over a frame, then radix sorted by key and submitted in that order. The shader, the
+// "model" uniform and the pass state are only changed between items that differ, textures and vertex
+// arrays are deduplicated by glState(). Equal keys keep the order they were submitted in.
+class RenderQueue {
+    public:
+        void clear()
+        {
+            items.clear();
+        }
+
+        size_t size() const { return items.size(); }
+
+        void submit(const RenderItem &item)
+        {
+            items.push_back(item);
+        }
+
+        void submit(Shader &shader, Mesh &mesh, const glm::mat4 &transform, float depth, unsigned int lod = 0)
+        {
+            RenderPass pass = mesh.transparent() ? RENDER_PASS_TRANSPARENT : RENDER_PASS_OPAQUE;
+            items.push_back({renderSortKey(pass, shader.ID, mesh.materialKey(), depth), &shader, &mesh, NULL, lod, transform});
+        }
+
+        // Batches are opaque and drawn ahead of the meshes sharing their shader
+        void submit(Shader &shader, StaticBatch &batch, const glm::mat4 &transform)
+        {
+            items.push_back({renderSortKey(RENDER_PASS_OPAQUE, shader.ID, 0, 0.0f), &shader, NULL, &batch, 0, transform});
+        }
+
+        // Sort, draw and empty the queue, leaving the opaque pass state set
+        void flush()
+        {
+            sort();
+
+            int pass = -1;
+            Shader *shader = NULL;
+            int modelLocation = -1;
+            const glm::mat4 *transform = NULL;
+            for (uint32_t index : order) {
+                RenderItem &item = items[index];
+
+                int itemPass = (int)(item.key >> 62);
+                if (itemPass != pass) {
+                    setPass(itemPass);
+                    pass = itemPass;
+                }
+                if (item.shader != shader) {
+                    shader = item.shader;
+                    shader->use();
+                    modelLocation = shader->location("model");
+                    transform = NULL;
+                }
+                if (!transform || *transform != item.transform) {
+                    shader->setMat4(modelLocation, item.transform);
+                    transform = &item.transform;
+                }
+
+                if (item.batch)
+                    item.batch->Draw(*shader);
+                else
+                    item.mesh->Draw(*shader, item.lod);
+            }
+
+            if (pass == RENDER_PASS_TRANSPARENT)
+                setPass(RENDER_PASS_OPAQUE);
+            clear();
+        }
+
+    private:
+        vector<RenderItem> items;
+        vector<uint64_t> keys, sortedKeys;
+        vector<uint32_t> order, sortedOrder;
+
+        // Least significant digit first radix sort of the keys, a byte per pass, carrying the item indices.
+        // Passes where every key has the same byte are skipped, which is most of them for a single model.
+        void sort()
+        {
+            size_t n = items.size();
+            keys.resize(n);
+            order.resize(n);
+            sortedKeys.resize(n);
+            sortedOrder.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                keys[i] = items[i].key;
+                order[i] = i;
+            }
+
+            size_t counts[8][256] = {};
+            for (uint64_t key : keys)
+                for (int digit = 0; digit < 8; digit++)
+                    counts[digit][(key >> (digit * 8)) & 0xFF]++;
+
+            for (int digit = 0; digit < 8; digit++) {
+                size_t *count = counts[digit];
+                if (n == 0 || count[(keys[0] >> (digit * 8)) & 0xFF] == n)
+                    continue;
+
+                size_t offset = 0;
+                for (int value = 0; value < 256; value++) {
+                    size_t c = count[value];
+                    count[value] = offset;
+                    offset += c;
+                }
+                for (size_t i = 0; i < n; i++) {
+                    size_t slot = count[(keys[i] >> (digit * 8)) & 0xFF]++;
+                    sortedKeys[slot] = keys[i];
+                    sortedOrder[slot] = order[i];
+                }
+                keys.swap(sortedKeys);
+                order.swap(sortedOrder);
+            }
+        }
+
+        void setPass(int pass)
+        {
+            if (pass == RENDER_PASS_TRANSPARENT) {
+                glState().enable(GL_BLEND);
+                // Alpha is accumulated as coverage, so what's read back keeps how opaque each pixel ended up
+                glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+                glState().depthMask(false);
+            } else {
+                glState().disable(GL_BLEND);
+                glState().depthMask(true);
+            }
+        }
+};
+
+#endif
@@ -1,8 +1,17 @@
 #version 330 core
 out vec4 FragColor;
 in vec2 TexCoords;
+in vec4 Tint;
+flat in float Layer;
 uniform sampler2D imageTexture;
+uniform float opacity = 1.0f;
+
+// Static batches sample every mesh's texture from one array, by the layer of each vertex
+uniform bool batched;
+uniform sampler2DArray batchTexture;
+
 void main()
 {
-    FragColor = texture(imageTexture, TexCoords);
+    vec4 colour = batched ? texture(batchTexture, vec3(TexCoords, Layer)) : texture(imageTexture, TexCoords);
+    FragColor = colour * Tint * vec4(1.0f, 1.0f, 1.0f, opacity);
 }
\ No newline at end of file
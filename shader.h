@@ -3,10 +3,54 @@
 
 #include <glad/glad.h>
 
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <cstdint>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <unordered_map>
+
+#include "glstate.h"
+
+// Uniform buffer binding points, every program's blocks of these names are attached to them when it links
+#define BONE_BINDING 0   // "Bones", the skinning palette
+#define CAMERA_BINDING 1 // "Camera", view and projection shared by every program
+
+#define MAX_BONES 128 // Size of the bone palette, must match the "Bones" block in shader.vert
+
+// Drawing with a program whose block has no buffer attached is undefined, so unless an Animator has attached
+// its palette to BONE_BINDING an identity palette, created once, is attached there
+void ensureBonePalette()
+{
+    GLint bound = 0;
+    glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, BONE_BINDING, &bound);
+    if (bound)
+        return;
+
+    static unsigned int ubo = 0;
+    if (!ubo)
+    {
+        std::vector<glm::mat4> identity(MAX_BONES, glm::mat4(1.0f));
+        glGenBuffers(1, &ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferData(GL_UNIFORM_BUFFER, MAX_BONES * sizeof(glm::mat4), identity.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+    glBindBufferBase(GL_UNIFORM_BUFFER, BONE_BINDING, ubo);
+}
+
+// 64-bit FNV-1a hash of a uniform name, uniforms are looked up by it instead of asking the driver
+constexpr uint64_t uniformHash(const char *name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    while (*name)
+        hash = (hash ^ (uint8_t)*name++) * 1099511628211ull;
+    return hash;
+}
 
 class Shader
 {
@@ -91,29 +135,139 @@ public:
         // -- Delete shaders after compiling
         glDeleteShader(vertexShader);
         glDeleteShader(fragmentShader);
+
+        reflectUniforms();
+        bindUniformBlock("Bones", BONE_BINDING);
+        bindUniformBlock("Camera", CAMERA_BINDING);
+        ensureBonePalette();
     };
 
     void use()
     {
-        glUseProgram(ID);
+        glState().useProgram(ID);
     };
 
-    void setBool(const std::string &name, bool value) const
+    // Location of an active uniform, -1 if the program doesn't use it
+    int location(const char *name) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        if (!collidedLocations.empty())
+        {
+            auto collided = collidedLocations.find(name);
+            if (collided != collidedLocations.end())
+                return collided->second;
+        }
+        auto it = locations.find(uniformHash(name));
+        return it != locations.end() ? it->second : -1;
+    };
+
+    // Set by location, for callers that look the locations they set every draw up once
+    void setBool(int location, bool value) const
+    {
+        glUniform1i(location, value);
     };
-    void setInt(const std::string &name, int value) const
+    void setInt(int location, int value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1i(location, value);
     };
-    void setFloat(const std::string &name, float value) const
+    void setFloat(int location, float value) const
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1f(location, value);
     };
-    void setMat4(const std::string &name, glm::mat4 value) const
+    void setVec3(int location, const glm::vec3 &value) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(value));
+        glUniform3fv(location, 1, &value[0]);
     };
+    void setMat4(int location, const glm::mat4 &value) const
+    {
+        glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+    };
+
+    void setBool(const char *name, bool value) const { setBool(location(name), value); };
+    void setInt(const char *name, int value) const { setInt(location(name), value); };
+    void setFloat(const char *name, float value) const { setFloat(location(name), value); };
+    void setVec3(const char *name, const glm::vec3 &value) const { setVec3(location(name), value); };
+    void setMat4(const char *name, const glm::mat4 &value) const { setMat4(location(name), value); };
+
+    void setBool(const std::string &name, bool value) const { setBool(name.c_str(), value); };
+    void setInt(const std::string &name, int value) const { setInt(name.c_str(), value); };
+    void setFloat(const std::string &name, float value) const { setFloat(name.c_str(), value); };
+    void setVec3(const std::string &name, const glm::vec3 &value) const { setVec3(name.c_str(), value); };
+    void setMat4(const std::string &name, const glm::mat4 &value) const { setMat4(name.c_str(), value); };
+
+private:
+    std::unordered_map<uint64_t, int> locations;
+    // Names whose hash an earlier uniform already took, looked up by name instead
+    std::unordered_map<std::string, int> collidedLocations;
+
+    // Ask the driver for every active uniform's location once, after linking
+    void reflectUniforms()
+    {
+        GLint numUniforms = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &numUniforms);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::string name(maxLength, '\0');
+        for (GLint i = 0; i < numUniforms; i++)
+        {
+            GLsizei length = 0;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(ID, i, maxLength, &length, &size, &type, &name[0]);
+            std::string uniform = name.substr(0, length);
+            int uniformLocation = glGetUniformLocation(ID, uniform.c_str());
+            // Members of uniform blocks have no location
+            if (uniformLocation < 0)
+                continue;
+            // Arrays are reported as "name[0]", also answer to the bare name
+            if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0)
+                uniform.resize(uniform.size() - 3);
+            if (!locations.emplace(uniformHash(uniform.c_str()), uniformLocation).second)
+            {
+                std::cout << "ERROR::SHADER::UNIFORM_HASH_COLLISION " << uniform << std::endl;
+                collidedLocations.emplace(uniform, uniformLocation);
+            }
+        }
+    };
+
+    void bindUniformBlock(const char *name, unsigned int binding)
+    {
+        unsigned int block = glGetUniformBlockIndex(ID, name);
+        if (block != GL_INVALID_INDEX)
+            glUniformBlockBinding(ID, block, binding);
+    };
+};
+
+// View and projection in a std140 uniform buffer, the "Camera" block, set once per frame for every program
+class CameraBuffer
+{
+public:
+    CameraBuffer()
+    {
+        glGenBuffers(1, &ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferData(GL_UNIFORM_BUFFER, 2 * sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    };
+
+    ~CameraBuffer()
+    {
+        glDeleteBuffers(1, &ubo);
+    };
+
+    CameraBuffer(const CameraBuffer&) = delete;
+    CameraBuffer& operator=(const CameraBuffer&) = delete;
+
+    // Upload the matrices and attach the buffer to CAMERA_BINDING
+    void set(const glm::mat4 &view, const glm::mat4 &projection)
+    {
+        glm::mat4 matrices[2] = { view, projection };
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glState().bufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(matrices), matrices);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, ubo);
+    };
+
+private:
+    unsigned int ubo = 0;
 };
 
 #endif
\ No newline at end of file
@@ -2,15 +2,104 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
+layout (location = 3) in mat4 aInstanceTransform; // Locations 3 to 6
+layout (location = 7) in vec4 aInstanceTint;
+layout (location = 8) in float aLayer;
+layout (location = 9) in uvec4 aBoneIds;
+layout (location = 10) in vec4 aBoneWeights;
+layout (location = 11) in float aInstanceTimeOffset;
 
 out vec2 TexCoords;
+out vec3 Normal;
+out vec4 Tint;
+flat out float Layer;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+
+// Shared by every program, CAMERA_BINDING in shader.h
+layout (std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+
+// Quantized meshes pass positions normalized within their bounds and octahedral normals in aNormal.xy
+uniform bool quantized;
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+
+// Skinned meshes are posed by a palette of bone matrices, MAX_BONES in shader.h
+#define MAX_BONES 128
+uniform bool skinned;
+layout (std140) uniform Bones
+{
+    mat4 bones[MAX_BONES];
+};
+
+// Instanced draws place each copy with its own transform on top of model
+uniform bool instanced;
+
+// Vertex animation textures hold every vertex's position and normal per frame, frame major, found by
+// the mesh's first vertex in the model plus gl_VertexID. Instances play at vatTime plus their own offset.
+uniform bool vertexAnimated;
+uniform sampler2D vatPositions;
+uniform sampler2D vatNormals;
+uniform int vatVertices;
+uniform int vatFirstFrame;
+uniform int vatFrames;
+uniform float vatFrameRate;
+uniform float vatTime;
+uniform int firstVertex;
+
+vec4 fetchFrame(sampler2D frames, int frame)
+{
+    int texel = (vatFirstFrame + frame) * vatVertices + firstVertex + gl_VertexID;
+    int width = textureSize(frames, 0).x;
+    return texelFetch(frames, ivec2(texel % width, texel / width), 0);
+}
+
+vec3 decodeOctahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0f);
+    n.xy += vec2(n.x >= 0.0f ? -t : t, n.y >= 0.0f ? -t : t);
+    return normalize(n);
+}
 
 void main()
 {
+    vec3 position = aPos;
+    Normal = aNormal;
+    if (quantized)
+    {
+        position = positionOffset + aPos * positionScale;
+        Normal = decodeOctahedral(aNormal.xy);
+    }
+    if (skinned && !vertexAnimated)
+    {
+        mat4 skin = aBoneWeights.x * bones[aBoneIds.x] + aBoneWeights.y * bones[aBoneIds.y]
+                  + aBoneWeights.z * bones[aBoneIds.z] + aBoneWeights.w * bones[aBoneIds.w];
+        position = vec3(skin * vec4(position, 1.0f));
+        Normal = mat3(skin) * Normal;
+    }
+    if (vertexAnimated)
+    {
+        float frame = mod((vatTime + (instanced ? aInstanceTimeOffset : 0.0f)) * vatFrameRate, float(vatFrames));
+        int current = int(frame);
+        int next = (current + 1) % vatFrames;
+        position = mix(fetchFrame(vatPositions, current).xyz, fetchFrame(vatPositions, next).xyz, fract(frame));
+        Normal = normalize(mix(fetchFrame(vatNormals, current).xyz, fetchFrame(vatNormals, next).xyz, fract(frame)));
+    }
+
+    mat4 world = model;
+    Tint = vec4(1.0f);
+    if (instanced)
+    {
+        world = aInstanceTransform * model;
+        Tint = aInstanceTint;
+    }
+
     TexCoords = aTexCoords;
-    gl_Position = projection * view * model * vec4(aPos, 1.0f);
+    Layer = aLayer;
+    gl_Position = projection * view * world * vec4(position, 1.0f);
 }
\ No newline at end of file
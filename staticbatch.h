@@ -0,0 +1,289 @@
+#ifndef STATICBATCH_H
+#define STATICBATCH_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "shader.h"
+#include "mesh.h"
+#include "glstate.h"
+#include "modelcache.h"
+
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <vector>
+#include <unordered_map>
+using namespace std;
+
+// Meshes merged into one vertex and index buffer with their textures packed into one texture array, so
+// they draw with a single call. Only meshes whose texture has the most common size and format are merged,
+// the rest are left to draw on their own. Node transforms are baked into the vertices.
+class StaticBatch {
+    public:
+        vector<uint8_t> unbatched; // Per mesh, 1 if it still has to be drawn on its own
+        unsigned int numBatched = 0;
+        unsigned int numLayers = 0;
+
+        StaticBatch() {}
+
+        ~StaticBatch()
+        {
+            release();
+        }
+
+        StaticBatch(const StaticBatch&) = delete;
+        StaticBatch& operator=(const StaticBatch&) = delete;
+
+        bool empty() const { return numIndices == 0; }
+
+        // Merge the meshes, which must have kept their geometry, at their full detail LOD
+        void build(const vector<Mesh> &meshes, const vector<SceneNode> &nodes)
+        {
+            release();
+            unbatched.assign(meshes.size(), 1);
+
+            // Size and format of the texture each mesh samples, the one on unit 0
+            struct TextureInfo {
+                GLint width, height, format, compressed;
+            };
+            unordered_map<unsigned int, TextureInfo> infos;
+            auto textureInfo = [&infos](unsigned int id) {
+                auto it = infos.find(id);
+                if (it != infos.end())
+                    return it->second;
+                TextureInfo info = {};
+                glState().bindTexture(GL_TEXTURE_2D, id);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &info.width);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &info.height);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &info.format);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &info.compressed);
+                infos[id] = info;
+                return info;
+            };
+            auto batchable = [](const Mesh &mesh) {
+                return !mesh.skinned && !mesh.transparent() && !mesh.textures.empty() && !mesh.vertices.empty() && !mesh.indices.empty();
+            };
+
+            map<tuple<GLint, GLint, GLint>, unsigned int> meshesPerKind;
+            for (const Mesh &mesh : meshes) {
+                if (!batchable(mesh))
+                    continue;
+                TextureInfo info = textureInfo(mesh.textures[0].id);
+                meshesPerKind[make_tuple(info.width, info.height, info.format)]++;
+            }
+            if (meshesPerKind.empty())
+                return;
+            auto kind = meshesPerKind.begin();
+            for (auto it = meshesPerKind.begin(); it != meshesPerKind.end(); ++it)
+                if (it->second > kind->second)
+                    kind = it;
+            if (kind->second < 2)
+                return;
+
+            // One layer per distinct texture, as many as the array can hold
+            GLint maxLayers = 0;
+            glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+            unordered_map<unsigned int, unsigned int> layerOf;
+            vector<unsigned int> layerTextures;
+            for (size_t m = 0; m < meshes.size(); m++) {
+                if (!batchable(meshes[m]))
+                    continue;
+                unsigned int id = meshes[m].textures[0].id;
+                TextureInfo info = textureInfo(id);
+                if (make_tuple(info.width, info.height, info.format) != kind->first)
+                    continue;
+                if (!layerOf.count(id)) {
+                    if ((GLint)layerTextures.size() >= maxLayers)
+                        continue;
+                    layerOf[id] = layerTextures.size();
+                    layerTextures.push_back(id);
+                }
+                unbatched[m] = 0;
+                numBatched++;
+            }
+
+            vector<glm::mat4> meshWorld(meshes.size(), glm::mat4(1.0f));
+            for (const SceneNode &node : nodes)
+                for (size_t m = node.firstMesh; m < node.firstMesh + node.numMeshes && m < meshes.size(); m++)
+                    meshWorld[m] = node.world;
+
+            vector<Vertex> vertices;
+            vector<float> layers;
+            vector<unsigned int> indices;
+            for (size_t m = 0; m < meshes.size(); m++) {
+                if (unbatched[m])
+                    continue;
+                const Mesh &mesh = meshes[m];
+                const glm::mat4 &world = meshWorld[m];
+                glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(world)));
+                unsigned int base = vertices.size();
+                for (Vertex vertex : mesh.vertices) {
+                    vertex.Position = glm::vec3(world * glm::vec4(vertex.Position, 1.0f));
+                    glm::vec3 normal = normalMatrix * vertex.Normal;
+                    if (glm::length(normal) > 0.0f)
+                        vertex.Normal = glm::normalize(normal);
+                    vertices.push_back(vertex);
+                    layers.push_back(layerOf[mesh.textures[0].id]);
+                }
+                const MeshLod &level = mesh.lods[0];
+                for (uint32_t i = 0; i < level.numIndices; i++)
+                    indices.push_back(base + mesh.indices[level.firstIndex + i]);
+            }
+
+            uploadGeometry(vertices, layers, indices);
+            uploadTextures(layerTextures, infos[layerTextures[0]].compressed != 0);
+            numLayers = layerTextures.size();
+        }
+
+        // Draw every merged mesh, the caller sets the "model" uniform
+        void Draw(Shader &shader)
+        {
+            DrawInstanced(shader, 0, 1);
+        }
+
+        // Draw count copies placed by the InstanceData in instanceBuffer, or just the one if it is 0
+        void DrawInstanced(Shader &shader, unsigned int instanceBuffer, unsigned int count)
+        {
+            if (empty())
+                return;
+
+            glState().bindTexture(BATCH_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, textureArray);
+            shader.setInt("batchTexture", BATCH_TEXTURE_UNIT);
+            shader.setBool("batched", true);
+            shader.setBool("quantized", false);
+            shader.setBool("skinned", false);
+            shader.setBool("vertexAnimated", false);
+            shader.setBool("instanced", instanceBuffer != 0);
+            shader.setFloat("opacity", 1.0f);
+
+            glState().bindVertexArray(VAO);
+            if (instanceBuffer)
+                bindInstanceAttributes(instanceBuffer);
+            glState().drawElements(GL_TRIANGLES, numIndices, indexType, 0, count);
+            if (instanceBuffer)
+                unbindInstanceAttributes();
+
+            shader.setBool("batched", false);
+        }
+
+    private:
+        unsigned int VAO = 0, VBO = 0, layerVBO = 0, EBO = 0;
+        unsigned int textureArray = 0;
+        unsigned int numIndices = 0;
+        GLenum indexType = GL_UNSIGNED_INT;
+
+        void release()
+        {
+            if (VAO) {
+                glState().deleteVertexArray(VAO);
+                glDeleteBuffers(1, &VBO);
+                glDeleteBuffers(1, &layerVBO);
+                glDeleteBuffers(1, &EBO);
+                glState().deleteTexture(textureArray);
+            }
+            VAO = VBO = layerVBO = EBO = textureArray = 0;
+            numIndices = numBatched = numLayers = 0;
+        }
+
+        void uploadGeometry(const vector<Vertex> &vertices, const vector<float> &layers, const vector<unsigned int> &indices)
+        {
+            numIndices = indices.size();
+
+            glGenVertexArrays(1, &VAO);
+            glGenBuffers(1, &VBO);
+            glGenBuffers(1, &layerVBO);
+            glGenBuffers(1, &EBO);
+            glState().bindVertexArray(VAO);
+
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+            if (vertices.size() <= 65536) {
+                indexType = GL_UNSIGNED_SHORT;
+                vector<uint16_t> shortIndices(indices.begin(), indices.end());
+                glState().bufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(uint16_t), shortIndices.data(), GL_STATIC_DRAW);
+            } else {
+                indexType = GL_UNSIGNED_INT;
+                glState().bufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+            }
+
+            glBindBuffer(GL_ARRAY_BUFFER, VBO);
+            glState().bufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+
+            // Texture array layer of each vertex
+            glBindBuffer(GL_ARRAY_BUFFER, layerVBO);
+            glState().bufferData(GL_ARRAY_BUFFER, layers.size() * sizeof(float), layers.data(), GL_STATIC_DRAW);
+            glEnableVertexAttribArray(8);
+            glVertexAttribPointer(8, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+
+            glState().bindVertexArray(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        // Copy each texture's mip chain into its layer of the array, reading it back from the GL
+        void uploadTextures(const vector<unsigned int> &textures, bool compressed)
+        {
+            GLint levels = 1000;
+            for (unsigned int id : textures) {
+                glState().bindTexture(GL_TEXTURE_2D, id);
+                GLint level = 0, width = 1;
+                while (level < levels) {
+                    glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &width);
+                    if (width == 0)
+                        break;
+                    level++;
+                }
+                levels = level;
+            }
+
+            glGenTextures(1, &textureArray);
+            glState().bindTexture(GL_TEXTURE_2D_ARRAY, textureArray);
+            vector<unsigned char> pixels;
+            for (GLint level = 0; level < levels; level++) {
+                GLint width, height, format, size = 0;
+                glState().bindTexture(GL_TEXTURE_2D, textures[0]);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &width);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &height);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_INTERNAL_FORMAT, &format);
+
+                if (compressed) {
+                    glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+                    glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, width, height, textures.size(), 0, size * textures.size(), NULL);
+                } else {
+                    size = width * height * 4;
+                    glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, width, height, textures.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+                }
+                pixels.resize(size);
+
+                for (size_t layer = 0; layer < textures.size(); layer++) {
+                    glState().bindTexture(GL_TEXTURE_2D, textures[layer]);
+                    if (compressed) {
+                        glGetCompressedTexImage(GL_TEXTURE_2D, level, pixels.data());
+                        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1, format, size, pixels.data());
+                        glState().uploaded(size);
+                    } else {
+                        glGetTexImage(GL_TEXTURE_2D, level, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+                        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+                        glState().uploaded(size);
+                    }
+                }
+            }
+
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glState().bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+            glState().bindTexture(GL_TEXTURE_2D, 0);
+        }
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef TEMPFILE_H
+#define TEMPFILE_H
+
+#include <atomic>
+#include <string>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Path next to path to write a file to before renaming it into place. Unique per process and per call, so
+// headless workers and loader threads writing the same cache file at once never share one.
+inline std::string tempFilePath(const std::string &path)
+{
+    static std::atomic<unsigned int> counter(0);
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    return path + ".tmp." + std::to_string(pid) + "." + std::to_string(counter++);
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <glad/glad.h>
+
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+#include "glstate.h"
+using namespace std;
+
+// Process-wide registry of GL textures shared between models.
+// Textures are found by canonical file path, or by content hash when the same image exists under
+// another path. Each model acquires the textures it uses and releases them when it is destroyed,
+// the GL texture is deleted once nothing references it.
+class TextureCache {
+    private:
+        struct Entry {
+            string path;
+            uint64_t hash;
+            unsigned int refs;
+        };
+
+        unordered_map<string, unsigned int>   byPath;
+        unordered_map<uint64_t, unsigned int> byHash;
+        unordered_map<unsigned int, Entry>    entries;
+        mutable mutex lock;
+
+        TextureCache() {}
+
+    public:
+        static TextureCache& instance()
+        {
+            static TextureCache cache;
+            return cache;
+        }
+
+        // Look up and acquire a texture by canonical path, returns 0 if it isn't loaded
+        unsigned int acquirePath(const string &canonicalPath)
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = byPath.find(canonicalPath);
+            if (it == byPath.end())
+                return 0;
+            entries[it->second].refs++;
+            return it->second;
+        }
+
+        // Look up and acquire a texture by content, remembering the new path as an alias
+        unsigned int acquireContent(uint64_t hash, const string &canonicalPath)
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = byHash.find(hash);
+            if (it == byHash.end())
+                return 0;
+            entries[it->second].refs++;
+            byPath[canonicalPath] = it->second;
+            return it->second;
+        }
+
+        // Register a newly uploaded texture, the caller holds the first reference
+        void add(unsigned int id, const string &canonicalPath, uint64_t hash)
+        {
+            lock_guard<mutex> guard(lock);
+            entries[id] = {canonicalPath, hash, 1};
+            byPath[canonicalPath] = id;
+            byHash[hash] = id;
+        }
+
+        void release(unsigned int id)
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = entries.find(id);
+            if (it == entries.end() || --it->second.refs > 0)
+                return;
+
+            // Drop every path that points at this texture
+            for (auto path = byPath.begin(); path != byPath.end();)
+                path = path->second == id ? byPath.erase(path) : next(path);
+            byHash.erase(it->second.hash);
+            entries.erase(it);
+            glState().deleteTexture(id);
+        }
+
+        size_t size() const
+        {
+            lock_guard<mutex> guard(lock);
+            return entries.size();
+        }
+};
+
+#endif
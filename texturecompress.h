@@ -0,0 +1,332 @@
+#ifndef TEXTURECOMPRESS_H
+#define TEXTURECOMPRESS_H
+
+#include <glad/glad.h>
+
+#include "tempfile.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+using namespace std;
+
+// S3TC formats, core GL 3.3 doesn't define them so they come from GL_EXT_texture_compression_s3tc
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT  0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// Bump whenever the encoder output changes so old cache files are rebuilt
+#define TEXTURE_CACHE_VERSION 2
+#define TEXTURE_CACHE_EXTENSION ".cf.dds"
+
+// Block compressed image with a full mip chain, levels are stored largest first
+struct CompressedImage {
+    GLenum format = GL_NONE;
+    struct Level {
+        unsigned int width, height;
+        size_t offset, size;
+    };
+    vector<Level> levels;
+    vector<unsigned char> data;
+};
+
+bool compressedTexturesSupported()
+{
+    GLint numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (GLint i = 0; i < numExtensions; i++)
+        if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_EXT_texture_compression_s3tc") == 0)
+            return true;
+    return false;
+}
+
+uint16_t packColor565(const float color[3])
+{
+    int r = std::clamp((int)(color[0] * 31.0f / 255.0f + 0.5f), 0, 31);
+    int g = std::clamp((int)(color[1] * 63.0f / 255.0f + 0.5f), 0, 63);
+    int b = std::clamp((int)(color[2] * 31.0f / 255.0f + 0.5f), 0, 31);
+    return (r << 11) | (g << 5) | b;
+}
+
+void unpackColor565(uint16_t packed, int color[3])
+{
+    int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+// Encode a 4x4 RGBA block as BC1 colour (8 bytes), endpoints are the extremes along the principal axis
+void encodeColorBlock(const unsigned char block[64], unsigned char out[8])
+{
+    float mean[3] = {0, 0, 0};
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < 3; c++)
+            mean[c] += block[i*4 + c] / 16.0f;
+
+    float covariance[6] = {0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        float r = block[i*4] - mean[0], g = block[i*4 + 1] - mean[1], b = block[i*4 + 2] - mean[2];
+        covariance[0] += r*r; covariance[1] += r*g; covariance[2] += r*b;
+        covariance[3] += g*g; covariance[4] += g*b; covariance[5] += b*b;
+    }
+
+    // Power iteration for the dominant direction
+    float axis[3] = {1.0f, 1.0f, 1.0f};
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float x = covariance[0]*axis[0] + covariance[1]*axis[1] + covariance[2]*axis[2];
+        float y = covariance[1]*axis[0] + covariance[3]*axis[1] + covariance[4]*axis[2];
+        float z = covariance[2]*axis[0] + covariance[4]*axis[1] + covariance[5]*axis[2];
+        float length = std::max(std::max(fabsf(x), fabsf(y)), fabsf(z));
+        if (length < 1e-6f)
+            break;
+        axis[0] = x / length; axis[1] = y / length; axis[2] = z / length;
+    }
+
+    float minProjection = 1e30f, maxProjection = -1e30f;
+    int minPixel = 0, maxPixel = 0;
+    for (int i = 0; i < 16; i++) {
+        float projection = block[i*4]*axis[0] + block[i*4 + 1]*axis[1] + block[i*4 + 2]*axis[2];
+        if (projection < minProjection) { minProjection = projection; minPixel = i; }
+        if (projection > maxProjection) { maxProjection = projection; maxPixel = i; }
+    }
+
+    float endpoint0[3], endpoint1[3];
+    for (int c = 0; c < 3; c++) {
+        endpoint0[c] = block[maxPixel*4 + c];
+        endpoint1[c] = block[minPixel*4 + c];
+    }
+    uint16_t color0 = packColor565(endpoint0), color1 = packColor565(endpoint1);
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    uint32_t indices = 0;
+    if (color0 != color1) {
+        // Four colour mode, two endpoints and two interpolated colours
+        int palette[4][3];
+        unpackColor565(color0, palette[0]);
+        unpackColor565(color1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+        }
+
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestDistance = INT32_MAX;
+            for (int p = 0; p < 4; p++) {
+                int dr = block[i*4] - palette[p][0], dg = block[i*4 + 1] - palette[p][1], db = block[i*4 + 2] - palette[p][2];
+                int distance = dr*dr + dg*dg + db*db;
+                if (distance < bestDistance) { bestDistance = distance; best = p; }
+            }
+            indices |= best << (i*2);
+        }
+    }
+
+    out[0] = color0 & 0xFF; out[1] = color0 >> 8;
+    out[2] = color1 & 0xFF; out[3] = color1 >> 8;
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = (indices >> (i*8)) & 0xFF;
+}
+
+// Encode the alpha of a 4x4 RGBA block as a BC3 alpha block (8 bytes)
+void encodeAlphaBlock(const unsigned char block[64], unsigned char out[8])
+{
+    int alpha0 = 0, alpha1 = 255;
+    for (int i = 0; i < 16; i++) {
+        alpha0 = std::max(alpha0, (int)block[i*4 + 3]);
+        alpha1 = std::min(alpha1, (int)block[i*4 + 3]);
+    }
+
+    uint64_t indices = 0;
+    if (alpha0 != alpha1) {
+        // Eight alpha mode, two endpoints and six interpolated values
+        int palette[8] = {alpha0, alpha1};
+        for (int p = 1; p < 7; p++)
+            palette[p + 1] = ((7 - p)*alpha0 + p*alpha1) / 7;
+
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestDistance = 256;
+            for (int p = 0; p < 8; p++) {
+                int distance = abs(block[i*4 + 3] - palette[p]);
+                if (distance < bestDistance) { bestDistance = distance; best = p; }
+            }
+            indices |= (uint64_t)best << (i*3);
+        }
+    }
+
+    out[0] = alpha0;
+    out[1] = alpha1;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (indices >> (i*8)) & 0xFF;
+}
+
+// Compress an image to BC1 (opaque) or BC3 (with alpha) and build the mip chain down to 1x1
+CompressedImage compressImage(const unsigned char *pixels, unsigned int width, unsigned int height, int nChannels)
+{
+    // Expand to RGBA, single channel images keep their value in red like the uncompressed GL_RED upload,
+    // grey and alpha images become (grey, grey, grey, alpha) like the swizzled GL_RG upload
+    vector<unsigned char> level(width * height * 4);
+    bool hasAlpha = false;
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        const unsigned char *p = pixels + i * nChannels;
+        unsigned char *q = &level[i*4];
+        q[0] = p[0];
+        q[1] = nChannels >= 3 ? p[1] : nChannels == 2 ? p[0] : 0;
+        q[2] = nChannels >= 3 ? p[2] : nChannels == 2 ? p[0] : 0;
+        q[3] = nChannels == 4 ? p[3] : nChannels == 2 ? p[1] : 255;
+        hasAlpha = hasAlpha || q[3] != 255;
+    }
+
+    CompressedImage image;
+    image.format = hasAlpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    size_t blockSize = hasAlpha ? 16 : 8;
+
+    while (true) {
+        unsigned int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+        CompressedImage::Level info = {width, height, image.data.size(), blocksX * blocksY * blockSize};
+        image.levels.push_back(info);
+        image.data.resize(info.offset + info.size);
+
+        unsigned char *out = &image.data[info.offset];
+        for (unsigned int by = 0; by < blocksY; by++)
+            for (unsigned int bx = 0; bx < blocksX; bx++) {
+                // Gather the block, repeating edge pixels past the border
+                unsigned char block[64];
+                for (unsigned int y = 0; y < 4; y++)
+                    for (unsigned int x = 0; x < 4; x++) {
+                        unsigned int sx = std::min(bx*4 + x, width - 1), sy = std::min(by*4 + y, height - 1);
+                        memcpy(&block[(y*4 + x)*4], &level[(sy*width + sx)*4], 4);
+                    }
+                if (hasAlpha) {
+                    encodeAlphaBlock(block, out);
+                    out += 8;
+                }
+                encodeColorBlock(block, out);
+                out += 8;
+            }
+
+        if (width == 1 && height == 1)
+            break;
+
+        // Box filter down to the next level
+        unsigned int nextWidth = std::max(1u, width / 2), nextHeight = std::max(1u, height / 2);
+        vector<unsigned char> next(nextWidth * nextHeight * 4);
+        for (unsigned int y = 0; y < nextHeight; y++)
+            for (unsigned int x = 0; x < nextWidth; x++) {
+                unsigned int x0 = std::min(x*2, width - 1), x1 = std::min(x*2 + 1, width - 1);
+                unsigned int y0 = std::min(y*2, height - 1), y1 = std::min(y*2 + 1, height - 1);
+                for (int c = 0; c < 4; c++)
+                    next[(y*nextWidth + x)*4 + c] = (level[(y0*width + x0)*4 + c] + level[(y0*width + x1)*4 + c]
+                                                   + level[(y1*width + x0)*4 + c] + level[(y1*width + x1)*4 + c] + 2) / 4;
+            }
+        level.swap(next);
+        width = nextWidth;
+        height = nextHeight;
+    }
+    return image;
+}
+
+// DDS container, the source hash is kept in the reserved words so stale files can be detected
+struct DDSHeader {
+    uint32_t magic, size, flags, height, width, pitchOrLinearSize, depth, mipMapCount;
+    uint32_t reserved1[11];
+    uint32_t pfSize, pfFlags, fourCC, rgbBitCount, rMask, gMask, bMask, aMask;
+    uint32_t caps, caps2, caps3, caps4, reserved2;
+};
+
+#define DDS_FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+bool writeCompressedImage(const string &path, uint64_t sourceHash, const CompressedImage &image)
+{
+    DDSHeader header = {};
+    header.magic = DDS_FOURCC('D', 'D', 'S', ' ');
+    header.size = 124;
+    header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000; // Caps, height, width, pixel format, mip count, linear size
+    header.width = image.levels[0].width;
+    header.height = image.levels[0].height;
+    header.pitchOrLinearSize = image.levels[0].size;
+    header.mipMapCount = image.levels.size();
+    header.reserved1[0] = DDS_FOURCC('C', 'F', 'T', 'C');
+    header.reserved1[1] = TEXTURE_CACHE_VERSION;
+    header.reserved1[2] = sourceHash & 0xFFFFFFFF;
+    header.reserved1[3] = sourceHash >> 32;
+    header.pfSize = 32;
+    header.pfFlags = 0x4; // Four CC
+    header.fourCC = image.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? DDS_FOURCC('D', 'X', 'T', '1') : DDS_FOURCC('D', 'X', 'T', '5');
+    header.caps = 0x1000 | 0x8 | 0x400000; // Texture, complex, mipmap
+
+    // Headless workers and loader threads may all transcode the same image at once
+    string tempPath = tempFilePath(path);
+    ofstream file(tempPath, ios::binary);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)image.data.data(), image.data.size());
+    file.close();
+
+    error_code error;
+    if (file)
+        filesystem::rename(tempPath, path, error);
+    if (!file || error) {
+        filesystem::remove(tempPath, error);
+        return false;
+    }
+    return true;
+}
+
+// Load a cached compressed image, fails if it is missing or was built from different source data
+bool readCompressedImage(const string &path, uint64_t sourceHash, CompressedImage &image)
+{
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file)
+        return false;
+    size_t fileSize = file.tellg();
+    file.seekg(0);
+
+    DDSHeader header;
+    if (fileSize < sizeof(header) || !file.read((char*)&header, sizeof(header)))
+        return false;
+    if (header.magic != DDS_FOURCC('D', 'D', 'S', ' ') || header.reserved1[0] != DDS_FOURCC('C', 'F', 'T', 'C')
+        || header.reserved1[1] != TEXTURE_CACHE_VERSION
+        || header.reserved1[2] != (sourceHash & 0xFFFFFFFF) || header.reserved1[3] != (sourceHash >> 32))
+        return false;
+
+    if (header.fourCC == DDS_FOURCC('D', 'X', 'T', '1'))
+        image.format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    else if (header.fourCC == DDS_FOURCC('D', 'X', 'T', '5'))
+        image.format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    else
+        return false;
+    size_t blockSize = image.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16;
+
+    // A full chain is floor(log2(max(width, height))) + 1 levels, more means the header is corrupt
+    unsigned int width = header.width, height = header.height;
+    uint32_t numLevels = std::max(1u, header.mipMapCount), maxLevels = 1;
+    if (width == 0 || height == 0)
+        return false;
+    for (unsigned int size = std::max(width, height); size > 1; size /= 2)
+        maxLevels++;
+    if (numLevels > maxLevels)
+        return false;
+
+    size_t offset = 0;
+    image.levels.clear();
+    for (uint32_t i = 0; i < numLevels; i++) {
+        size_t size = (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockSize;
+        if (size > fileSize - sizeof(header) - offset)
+            return false;
+        image.levels.push_back({width, height, offset, size});
+        offset += size;
+        width = std::max(1u, width / 2);
+        height = std::max(1u, height / 2);
+    }
+
+    image.data.resize(offset);
+    return (bool)file.read((char*)image.data.data(), offset);
+}
+
+#endif
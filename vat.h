@@ -0,0 +1,288 @@
+#ifndef VAT_H
+#define VAT_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "shader.h"
+#include "mesh.h"
+#include "model.h"
+#include "animation.h"
+#include "glstate.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+using namespace std;
+
+#define VAT_FILE_VERSION 1
+#define VAT_FILE_EXTENSION ".cfvat"
+#define VAT_TEXTURE_WIDTH 1024 // Texels per row, the smallest GL_MAX_TEXTURE_SIZE GL 3.3 allows
+
+// Texture units vertex animation textures are bound to while drawing
+#define VAT_POSITION_UNIT 13
+#define VAT_NORMAL_UNIT 14
+
+// One clip's frames within a baked vertex animation
+struct VertexAnimationClip {
+    string name;
+    uint32_t firstFrame, numFrames;
+    float frameRate;
+};
+
+// Position and normal of every vertex of a model for every frame of its animations, frame major.
+// Vertices are in the model's flattened order (Mesh::firstVertex), so the vertex shader finds its texel
+// from the frame, the mesh's first vertex and gl_VertexID.
+struct VertexAnimation {
+    uint32_t numVertices = 0;
+    vector<VertexAnimationClip> clips;
+    vector<glm::vec4> positions;
+    vector<glm::vec4> normals;
+};
+
+struct VertexAnimationHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t numVertices, numFrames, numClips;
+};
+
+// Sample every animation clip of a rigged or node animated model at frameRate, skinning on the CPU.
+// The model must have been loaded with keepGeometry. Positions are stored so that drawing them with the
+// usual per node "model" uniform puts them where the animation would.
+bool bakeVertexAnimation(const Model &model, float frameRate, VertexAnimation &baked)
+{
+    baked = VertexAnimation();
+    if (model.animations.empty()) {
+        cout << "ERROR::VAT::NO_ANIMATIONS" << endl;
+        return false;
+    }
+    for (const Mesh &mesh : model.meshes) {
+        if (mesh.vertices.empty() || (mesh.skinned && mesh.skin.size() != mesh.vertices.size())) {
+            cout << "ERROR::VAT::GEOMETRY_NOT_KEPT load the model with keepGeometry to bake it" << endl;
+            return false;
+        }
+        baked.numVertices = std::max<uint32_t>(baked.numVertices, mesh.firstVertex + mesh.vertices.size());
+    }
+    if (baked.numVertices == 0) {
+        cout << "ERROR::VAT::NO_VERTICES" << endl;
+        return false;
+    }
+
+    // Unskinned meshes follow their node, relative to the bind pose the draw already applies
+    vector<int> meshNode(model.meshes.size(), -1);
+    for (size_t n = 0; n < model.nodes.size(); n++)
+        for (size_t m = model.nodes[n].firstMesh; m < model.nodes[n].firstMesh + model.nodes[n].numMeshes && m < meshNode.size(); m++)
+            meshNode[m] = n;
+
+    Animator animator(model.nodes, model.bones, model.animations);
+    for (size_t a = 0; a < model.animations.size(); a++) {
+        const Animation &animation = model.animations[a];
+        double seconds = animation.duration / animation.ticksPerSecond;
+        VertexAnimationClip clip;
+        clip.name = animation.name;
+        clip.firstFrame = baked.positions.size() / baked.numVertices;
+        clip.numFrames = std::max(1, (int)ceil(seconds * frameRate));
+        clip.frameRate = frameRate;
+        baked.clips.push_back(clip);
+
+        animator.play(a);
+        for (uint32_t frame = 0; frame < clip.numFrames; frame++) {
+            animator.time = frame / frameRate * animation.ticksPerSecond;
+            animator.pose();
+            size_t base = baked.positions.size();
+            baked.positions.resize(base + baked.numVertices, glm::vec4(0.0f));
+            baked.normals.resize(base + baked.numVertices, glm::vec4(0.0f));
+
+            for (size_t m = 0; m < model.meshes.size(); m++) {
+                const Mesh &mesh = model.meshes[m];
+                glm::mat4 rigid(1.0f);
+                if (!mesh.skinned && meshNode[m] >= 0)
+                    rigid = glm::inverse(model.nodes[meshNode[m]].world) * animator.worldTransforms()[meshNode[m]];
+
+                for (size_t v = 0; v < mesh.vertices.size(); v++) {
+                    glm::mat4 transform = rigid;
+                    if (mesh.skinned) {
+                        transform = glm::mat4(0.0f);
+                        for (int k = 0; k < MAX_BONE_INFLUENCE; k++)
+                            if (mesh.skin[v].Weights[k] > 0.0f && mesh.skin[v].BoneIDs[k] < animator.palette.size())
+                                transform += mesh.skin[v].Weights[k] * animator.palette[mesh.skin[v].BoneIDs[k]];
+                    }
+                    glm::vec3 normal = glm::mat3(transform) * mesh.vertices[v].Normal;
+                    baked.positions[base + mesh.firstVertex + v] = transform * glm::vec4(mesh.vertices[v].Position, 1.0f);
+                    baked.normals[base + mesh.firstVertex + v] = glm::vec4(glm::length(normal) > 0.0f ? glm::normalize(normal) : normal, 0.0f);
+                }
+            }
+        }
+    }
+
+    cout << "Baked " << baked.clips.size() << " clips, " << baked.positions.size() / baked.numVertices << " frames of "
+         << baked.numVertices << " vertices" << endl;
+    return true;
+}
+
+bool writeVertexAnimation(const string &path, const VertexAnimation &baked)
+{
+    ofstream file(path, ios::binary);
+    if (!file) {
+        cout << "ERROR::VAT::FILE_NOT_WRITTEN " << path << endl;
+        return false;
+    }
+
+    VertexAnimationHeader header = {};
+    memcpy(header.magic, "CFVA", 4);
+    header.version = VAT_FILE_VERSION;
+    header.numVertices = baked.numVertices;
+    header.numFrames = baked.numVertices ? baked.positions.size() / baked.numVertices : 0;
+    header.numClips = baked.clips.size();
+    file.write((const char*)&header, sizeof(header));
+
+    for (const VertexAnimationClip &clip : baked.clips) {
+        uint32_t nameLength = clip.name.size();
+        file.write((const char*)&nameLength, sizeof(nameLength));
+        file.write(clip.name.data(), nameLength);
+        file.write((const char*)&clip.firstFrame, sizeof(clip.firstFrame));
+        file.write((const char*)&clip.numFrames, sizeof(clip.numFrames));
+        file.write((const char*)&clip.frameRate, sizeof(clip.frameRate));
+    }
+    file.write((const char*)baked.positions.data(), baked.positions.size() * sizeof(glm::vec4));
+    file.write((const char*)baked.normals.data(), baked.normals.size() * sizeof(glm::vec4));
+
+    if (!file) {
+        cout << "ERROR::VAT::FILE_NOT_WRITTEN " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+bool readVertexAnimation(const string &path, VertexAnimation &baked)
+{
+    baked = VertexAnimation();
+    ifstream file(path, ios::binary);
+    VertexAnimationHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "CFVA", 4) != 0 || header.version != VAT_FILE_VERSION) {
+        cout << "ERROR::VAT::FILE_NOT_READ " << path << endl;
+        return false;
+    }
+
+    baked.numVertices = header.numVertices;
+    for (uint32_t c = 0; c < header.numClips; c++) {
+        VertexAnimationClip clip;
+        uint32_t nameLength = 0;
+        file.read((char*)&nameLength, sizeof(nameLength));
+        clip.name.resize(nameLength);
+        file.read(&clip.name[0], nameLength);
+        file.read((char*)&clip.firstFrame, sizeof(clip.firstFrame));
+        file.read((char*)&clip.numFrames, sizeof(clip.numFrames));
+        file.read((char*)&clip.frameRate, sizeof(clip.frameRate));
+        if (!file || clip.numFrames == 0 || clip.firstFrame > header.numFrames || clip.numFrames > header.numFrames - clip.firstFrame
+            || !(clip.frameRate > 0.0f)) {
+            cout << "ERROR::VAT::FILE_NOT_READ " << path << endl;
+            baked = VertexAnimation();
+            return false;
+        }
+        baked.clips.push_back(clip);
+    }
+    size_t numTexels = (size_t)header.numVertices * header.numFrames;
+    baked.positions.resize(numTexels);
+    baked.normals.resize(numTexels);
+    file.read((char*)baked.positions.data(), numTexels * sizeof(glm::vec4));
+    file.read((char*)baked.normals.data(), numTexels * sizeof(glm::vec4));
+
+    if (!file) {
+        cout << "ERROR::VAT::FILE_NOT_READ " << path << endl;
+        baked = VertexAnimation();
+        return false;
+    }
+    return true;
+}
+
+// A baked vertex animation uploaded as float textures for playback in the vertex shader, no bones needed.
+// Bind it, draw the model it was baked from (instanced draws add each instance's timeOffset), then unbind.
+class VertexAnimationTexture {
+    public:
+        vector<VertexAnimationClip> clips;
+        uint32_t numVertices = 0;
+
+        VertexAnimationTexture(const VertexAnimation &baked) : clips(baked.clips), numVertices(baked.numVertices)
+        {
+            size_t numTexels = baked.positions.size();
+            if (numTexels == 0)
+                return;
+
+            GLint maxSize = 0;
+            glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+            size_t height = (numTexels + VAT_TEXTURE_WIDTH - 1) / VAT_TEXTURE_WIDTH;
+            if (height > (size_t)maxSize) {
+                cout << "ERROR::VAT::TOO_LARGE " << numTexels << " texels" << endl;
+                clips.clear();
+                return;
+            }
+
+            positions = uploadTexels(baked.positions, height, GL_RGBA32F);
+            normals = uploadTexels(baked.normals, height, GL_RGBA16F);
+        }
+
+        ~VertexAnimationTexture()
+        {
+            if (positions)
+                glState().deleteTexture(positions);
+            if (normals)
+                glState().deleteTexture(normals);
+        }
+
+        VertexAnimationTexture(const VertexAnimationTexture&) = delete;
+        VertexAnimationTexture& operator=(const VertexAnimationTexture&) = delete;
+
+        // Play a clip at time seconds, looping
+        void bind(Shader &shader, size_t clip, float time)
+        {
+            if (clip >= clips.size())
+                return;
+
+            glState().bindTexture(VAT_POSITION_UNIT, GL_TEXTURE_2D, positions);
+            glState().bindTexture(VAT_NORMAL_UNIT, GL_TEXTURE_2D, normals);
+
+            shader.setInt("vatPositions", VAT_POSITION_UNIT);
+            shader.setInt("vatNormals", VAT_NORMAL_UNIT);
+            shader.setInt("vatVertices", numVertices);
+            shader.setInt("vatFirstFrame", clips[clip].firstFrame);
+            shader.setInt("vatFrames", clips[clip].numFrames);
+            shader.setFloat("vatFrameRate", clips[clip].frameRate);
+            shader.setFloat("vatTime", time);
+            shader.setBool("vertexAnimated", true);
+        }
+
+        void unbind(Shader &shader)
+        {
+            shader.setBool("vertexAnimated", false);
+        }
+
+    private:
+        unsigned int positions = 0, normals = 0;
+
+        static unsigned int uploadTexels(const vector<glm::vec4> &texels, size_t height, GLenum internalFormat)
+        {
+            vector<glm::vec4> padded(texels);
+            padded.resize(height * VAT_TEXTURE_WIDTH, glm::vec4(0.0f));
+
+            unsigned int texture;
+            glGenTextures(1, &texture);
+            glState().bindTexture(GL_TEXTURE_2D, texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, VAT_TEXTURE_WIDTH, height, 0, GL_RGBA, GL_FLOAT, padded.data());
+            glState().uploaded(padded.size() * sizeof(glm::vec4));
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glState().bindTexture(GL_TEXTURE_2D, 0);
+            return texture;
+        }
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+// Fixed pool of worker threads fed from a bounded job queue
+class WorkQueue {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    unsigned int capacity;
+    unsigned int active = 0;
+    bool stopping = false;
+
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::condition_variable slotAvailable;
+    std::condition_variable idle;
+
+public:
+    // A capacity of 0 lets the queue grow without limit
+    WorkQueue(unsigned int numThreads, unsigned int capacity = 0) : capacity(capacity) {
+        if (numThreads == 0)
+            numThreads = 1;
+        for (unsigned int i = 0; i < numThreads; i++)
+            threads.emplace_back([this]() { workerLoop(); });
+    }
+
+    ~WorkQueue() {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobAvailable.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    unsigned int numThreads() const {
+        return threads.size();
+    }
+
+    // Add a job, blocking while the queue is full
+    void push(std::function<void()> job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        slotAvailable.wait(lock, [this]() { return capacity == 0 || jobs.size() < capacity; });
+        jobs.push_back(std::move(job));
+        lock.unlock();
+        jobAvailable.notify_one();
+    }
+
+    // Block until every queued job has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return jobs.empty() && active == 0; });
+    }
+
+private:
+    void workerLoop() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                active++;
+            }
+            slotAvailable.notify_one();
+
+            job();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+                if (jobs.empty() && active == 0)
+                    idle.notify_all();
+            }
+        }
+    }
+};
+
+// Run body(i) for every i in [0, count) spread over the machine's cores, returns once all are done
+inline void parallelFor(size_t count, const std::function<void(size_t)>& body) {
+    size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+    if (numThreads <= 1) {
+        for (size_t i = 0; i < count; i++)
+            body(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++)
+            body(i);
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < numThreads; t++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+#endif